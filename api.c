@@ -0,0 +1,586 @@
+/* Copyright (C) 2022 Jeremiah Orians
+ * This file is part of GFK
+ *
+ * GFK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GFK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GFK If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gfk_create.h"
+#include <sys/mman.h>
+
+/* Every gfk_* call points unwind at its own jmp_buf for as long as it runs (so
+ * do the pool workers and the prefetch reader) which is where fail() goes back
+ * to; anything that isn't inside one of those still ends the process
+ */
+__thread jmp_buf* unwind;
+
+void fail(struct gfk* g, char* message)
+{
+	/* Only the first thing that went wrong is worth reporting */
+	if(!__atomic_exchange_n(&g->failed, TRUE, __ATOMIC_ACQ_REL)) g->error = strdup(message);
+	if(NULL != unwind) longjmp(*unwind, 1);
+	fputs(message, stderr);
+	exit(EXIT_FAILURE);
+}
+
+void ensure(struct gfk* g, int condition, char* message)
+{
+	if(!condition) fail(g, message);
+}
+
+void forget_error(struct gfk* g)
+{
+	g->failed = FALSE;
+	free(g->error);
+	g->error = NULL;
+}
+
+char* gfk_error(struct gfk* g)
+{
+	return g->error;
+}
+
+/* Keep track of the strings the tree ends up pointing into */
+char* remember(struct gfk* g, char* s)
+{
+	ensure(g, NULL != s, "strdup failed\n");
+	if(g->string_count == g->string_capacity)
+	{
+		g->string_capacity = (g->string_capacity << 1) + 64;
+		g->strings = realloc(g->strings, g->string_capacity * sizeof(char*));
+		ensure(g, NULL != g->strings, "realloc failed in remember\n");
+	}
+	g->strings[g->string_count] = s;
+	g->string_count = g->string_count + 1;
+	return s;
+}
+
+struct gfk* gfk_new()
+{
+	struct gfk* g = calloc(1, sizeof(struct gfk));
+	if(NULL == g) return NULL;
+	g->filesystem = calloc(1, sizeof(struct folders));
+	if(NULL == g->filesystem)
+	{
+		free(g);
+		return NULL;
+	}
+	g->filesystem->name = "/";
+
+	/* Assume GFK defaults */
+	g->BigByteEndian = TRUE;
+	g->BigBitEndian = TRUE;
+	g->checksum_mode = 1;
+	g->checksum_size = 32;
+	g->native_block_size = 0;
+	g->volume_block_size = 4096;
+	g->block_pointer_size = 4;
+	g->file_size_size = 8;
+	g->prefetch_files = 8;
+	g->prefetch_budget = 4 << 20;
+	g->pool_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	g->output_fd = -1;
+	g->write_fd = -1;
+	stats_clear(g);
+	return g;
+}
+
+void free_folders(struct folders* a)
+{
+	struct folders* next_folder;
+	struct files* f;
+	struct files* next_file;
+	while(NULL != a)
+	{
+		f = a->f;
+		while(NULL != f)
+		{
+			next_file = f->next;
+			close_input(f);
+			free(f->path);
+			free(f);
+			f = next_file;
+		}
+		free_folders(a->sub);
+		next_folder = a->next;
+		free(a);
+		a = next_folder;
+	}
+}
+
+void gfk_free(struct gfk* g)
+{
+	long i = 0;
+	if(NULL == g) return;
+	free_folders(g->filesystem);
+	while(i < g->string_count)
+	{
+		free(g->strings[i]);
+		i = i + 1;
+	}
+	free(g->strings);
+	external_free(g);
+	free(g->error);
+	free(g);
+}
+
+int image_option(struct gfk* g, char* option, char* hold)
+{
+	if(match(option, "--big-byte-endian"))
+	{
+		g->BigByteEndian = TRUE;
+		return 1;
+	}
+	else if(match(option, "--little-byte-endian"))
+	{
+		g->BigByteEndian = FALSE;
+		return 1;
+	}
+	else if(match(option, "--big-bit-endian") || match(option, "--little-bit-endian"))
+	{
+		/* The standard only allows big bit endian encoding flags and has no
+		 * flag for bit order, so these change nothing; they are still
+		 * accepted so existing command lines keep working
+		 */
+		return 1;
+	}
+	else if(match(option, "--quiet"))
+	{
+		g->quiet_mode = TRUE;
+		return 1;
+	}
+	else if(match(option, "--auto-geometry") || match(option, "--auto-geometry=size"))
+	{
+		g->auto_geometry = GEOMETRY_SIZE;
+		return 1;
+	}
+	else if(match(option, "--auto-geometry=reads"))
+	{
+		g->auto_geometry = GEOMETRY_READS;
+		return 1;
+	}
+	else if(match(option, "--pack-tails"))
+	{
+		g->pack_tails = TRUE;
+		return 1;
+	}
+	else if(match(option, "--direct"))
+	{
+		g->direct_mode = TRUE;
+		return 1;
+	}
+	else if(match(option, "--threads"))
+	{
+		ensure(g, NULL != hold, "the option --threads needs to get an integer to work\n");
+		g->pool_threads = strtoint(hold);
+		ensure(g, 0 < g->pool_threads, "need at least one thread\n");
+		return 2;
+	}
+	else if(match(option, "--prefetch-files"))
+	{
+		ensure(g, NULL != hold, "the option --prefetch-files needs to get an integer to work\n");
+		g->prefetch_files = strtoint(hold);
+		ensure(g, 0 <= g->prefetch_files, "can't prefetch a negative number of files\n");
+		return 2;
+	}
+	else if(match(option, "--prefetch-budget"))
+	{
+		ensure(g, NULL != hold, "the option --prefetch-budget needs to get a number of bytes to work\n");
+		g->prefetch_budget = strtoint(hold);
+		ensure(g, 0 <= g->prefetch_budget, "a negative prefetch budget isn't valid\n");
+		return 2;
+	}
+	else if(match(option, "--master-boot-record") || match(option, "-mbr"))
+	{
+		ensure(g, NULL != hold, "the option --master-boot-record needs to get a file name to work\n");
+		g->MBR = remember(g, strdup(hold));
+		return 2;
+	}
+	else if(match(option, "--native-block-size") || match(option, "-nbs"))
+	{
+		ensure(g, NULL != hold, "the option --native-block-size needs to get an integer or auto to work\n");
+		if(match(hold, "auto"))
+		{
+			/* Let open_output ask the device */
+			g->native_block_size = 0;
+		}
+		else
+		{
+			g->native_block_size = strtoint(hold);
+			ensure(g, 64 < g->native_block_size, "we don't support native block sizes smaller than 64bytes\n");
+		}
+		return 2;
+	}
+	else if(match(option, "--volume-block-size") || match(option, "-vbs"))
+	{
+		ensure(g, NULL != hold, "the option --volume-block-size needs to get an integer to work\n");
+		g->volume_block_size = strtoint(hold);
+		ensure(g, 64 < g->volume_block_size, "we don't support volume block sizes smaller than 64bytes\n");
+		return 2;
+	}
+	else if(match(option, "--checksum-algorithm") || match(option, "-ca"))
+	{
+		ensure(g, NULL != hold, "the option --checksum-algorithm needs to get an integer to work\n");
+		g->checksum_mode = strtoint(hold);
+		return 2;
+	}
+	else if(match(option, "--checksum-block-size") || match(option, "-cs"))
+	{
+		ensure(g, NULL != hold, "the option --checksum-block-size needs to get an integer to work\n");
+		g->checksum_size = strtoint(hold);
+		ensure(g, 0 != g->checksum_size, "a checksum size of zero isn't valid\nIf you wish to disable checksums change the algorithm to zero\n");
+		return 2;
+	}
+	else if(match(option, "--file-size-block-size") || match(option, "-fsbs"))
+	{
+		ensure(g, NULL != hold, "the option --file-size-block-size needs to get an integer to work\n");
+		g->file_size_size = strtoint(hold);
+		ensure(g, 0 < g->file_size_size, "zero bytes can't encode any file size info\nNot valid\n");
+		return 2;
+	}
+	else if(match(option, "--block-pointer-size") || match(option, "-bps"))
+	{
+		ensure(g, NULL != hold, "the option --block-pointer-size needs to get an integer to work\n");
+		g->block_pointer_size = strtoint(hold);
+		ensure(g, (2 == g->block_pointer_size) || (4 == g->block_pointer_size) || (8 == g->block_pointer_size), "only 2, 4 and 8 byte block pointers are supported\n");
+		return 2;
+	}
+	return 0;
+}
+
+/* The gfk_* calls below all have the same shape: anything fail() is told
+ * about lands back here with g->failed set and the message in g->error
+ */
+int gfk_option(struct gfk* g, char* option, char* value)
+{
+	jmp_buf here;
+	jmp_buf* outer = unwind;
+	int used = 0;
+	forget_error(g);
+	unwind = &here;
+	if(0 == setjmp(here)) used = image_option(g, option, value);
+	unwind = outer;
+	if(g->failed) return -1;
+	return used;
+}
+
+int gfk_add_path(struct gfk* g, char* path)
+{
+	jmp_buf here;
+	jmp_buf* outer = unwind;
+	if((NULL == path) || (0 == path[0])) return -1;
+	forget_error(g);
+	unwind = &here;
+	if(0 == setjmp(here))
+	{
+		/* The merge keeps its own copy of the path */
+		if(0 != g->max_memory) process_file(g, path);
+		else process_file(g, remember(g, strdup(path)));
+	}
+	unwind = outer;
+	if(g->failed) return -1;
+	return 0;
+}
+
+int gfk_add_buffer(struct gfk* g, char* path, char* data, long size)
+{
+	jmp_buf here;
+	jmp_buf* outer = unwind;
+	if((NULL == path) || (0 == path[0]) || (0 > size)) return -1;
+	struct files* f = calloc(1, sizeof(struct files));
+	if(NULL == f) return -1;
+	f->data = data;
+	if(NULL == f->data) f->data = "";
+	f->size = size;
+	f->fd = -1;
+
+	forget_error(g);
+	unwind = &here;
+	if(0 == setjmp(here))
+	{
+		g->stats.files_ingested = g->stats.files_ingested + 1;
+		g->stats.bytes_ingested = g->stats.bytes_ingested + size;
+		place_file(g, f, remember(g, strdup(path)));
+	}
+	unwind = outer;
+	if(g->failed)
+	{
+		/* place_file only links it in once every folder on its path exists */
+		free(f);
+		return -1;
+	}
+	return 0;
+}
+
+void forget_output(struct gfk* g)
+{
+	g->output_name = NULL;
+	g->output_fd = -1;
+	g->output_truncate = FALSE;
+	g->output_buffer = NULL;
+	g->output_capacity = 0;
+}
+
+void gfk_output_path(struct gfk* g, char* name)
+{
+	forget_output(g);
+	g->output_name = remember(g, strdup(name));
+}
+
+void gfk_output_fd(struct gfk* g, int fd)
+{
+	forget_output(g);
+	g->output_fd = fd;
+}
+
+/* The memfd belongs to the caller; it starts over empty for every build */
+int gfk_output_memfd(struct gfk* g)
+{
+	forget_output(g);
+	g->output_fd = memfd_create("gfk", MFD_CLOEXEC);
+	if(0 > g->output_fd) return -1;
+	g->output_truncate = TRUE;
+	return g->output_fd;
+}
+
+void gfk_output_buffer(struct gfk* g, char* buffer, long capacity)
+{
+	forget_output(g);
+	g->output_buffer = buffer;
+	g->output_capacity = capacity;
+}
+
+/* Everything after ingest; run once per image we emit once the output is set up.
+ * Leaves the size of the image in g->image_size, which isn't written if the
+ * output buffer is too small
+ */
+void build_image(struct gfk* g)
+{
+	/* Setup our first buffer */
+	g->allocated = create_buffer(g, NULL, g->native_block_size);
+	remove_buffer(g, g->allocated);
+
+	/* Pick block, pointer and checksum sizes for the user */
+	if(GEOMETRY_OFF != g->auto_geometry) choose_geometry(g);
+
+	/* Sanity check checksum combos */
+	if(0 == g->checksum_mode)
+	{
+		if(!g->quiet_mode)
+		{
+			fputs("the NULL algorithm is not to be generated\n", stdout);
+			fputs("Disabling checksuming in output filesystem\n", stdout);
+		}
+		g->checksum_size = 0;
+	}
+	else if(1 == g->checksum_mode)
+	{
+		if(16 == g->checksum_size)
+		{
+			if(!g->quiet_mode) fputs("Using BSD checksum 16bit mode\n", stdout);
+		}
+		else if(32 == g->checksum_size)
+		{
+			if(!g->quiet_mode) fputs("Using BSD checksum 32bit mode\n", stdout);
+		}
+		else if(64 == g->checksum_size)
+		{
+			fail(g, "You have selected BSD checksum 64bit mode\nAlthough this mode is entirely valid\nThis tool doesn't actually support it\nSorry\n");
+		}
+		else
+		{
+			fail(g, "You have selected an invalid checksum size for the BSD checksum\nThe only officially valid sizes are 16, 32 or 64bits\n");
+		}
+	}
+	else if(2 == g->checksum_mode)
+	{
+		if(128 == g->checksum_size)
+		{
+			fail(g, "You have selected MD5 checksum 128bit mode\nAlthough this mode is entirely valid\nThis tool doesn't actually support it\nSorry\n");
+		}
+		else
+		{
+			fail(g, "You have selected an invalid checksum size for the MD5 checksum\nThe only officially valid size is 128bits\n");
+		}
+	}
+	else if(3 == g->checksum_mode)
+	{
+		if(160 == g->checksum_size)
+		{
+			fail(g, "You have selected SHA-1 checksum 160bit mode\nAlthough this mode is entirely valid\nThis tool doesn't actually support it\nSorry\n");
+		}
+		else
+		{
+			fail(g, "You have selected an invalid checksum size for the SHA-1 checksum\nThe only officially valid size is 160bits\n");
+		}
+	}
+	else if(4 == g->checksum_mode)
+	{
+		if(224 == g->checksum_size)
+		{
+			fail(g, "You have selected SHA-2 checksum 2248bit mode\nAlthough this mode is entirely valid\nThis tool doesn't actually support it\nSorry\n");
+		}
+		else if(256 == g->checksum_size)
+		{
+			fail(g, "You have selected SHA-2 checksum 256bit mode\n");
+		}
+		else if(384 == g->checksum_size)
+		{
+			fail(g, "You have selected SHA-2 checksum 384bit mode\n");
+		}
+		else if(512 == g->checksum_size)
+		{
+			fail(g, "You have selected SHA-2 checksum 512bit mode\n");
+		}
+		else
+		{
+			fail(g, "You have selected an invalid checksum size for the MD5 checksum\nThe only officially valid sizes are 224, 256, 384 and 512bits\n");
+		}
+	}
+	else
+	{
+		fail(g, "You have selected an entirely undefined checksum id\nCongrats, that isn't valid and I'm not supporting that\nGoodbye\n");
+	}
+
+	g->inode_size = g->block_pointer_size + (g->checksum_size / 8);
+	g->dnode_size = (g->inode_size << 1) + g->file_size_size;
+	ensure(g, (g->dnode_size << 2) <= g->volume_block_size, "block size is too small\n");
+	select_encoders(g);
+
+	/* Sanity warning message */
+	if((NULL == g->MBR) && !g->quiet_mode)
+	{
+		fputs("You didn't set an MBR\n", stderr);
+		fputs("I really hope you know what you are doing\n", stderr);
+		fputs("Because this probably isn't going to work\n", stderr);
+	}
+
+	long start = stats_start(g);
+	long volume_blocks_needed;
+	if(0 != g->max_memory)
+	{
+		volume_blocks_needed = external_blocks_needed(g);
+	}
+	else
+	{
+		/* Only now do we know the block size names have to fit in */
+		check_names(g, g->filesystem);
+		volume_blocks_needed = blocks_needed_for_folders(g, g->filesystem);
+	}
+	stats_stop(g, STAT_PHASE_PLAN, start);
+	if(!g->quiet_mode)
+	{
+		fputs("projected block need: ", stdout);
+		fput_long(volume_blocks_needed, stdout);
+		fputs(" blocks to write these files\n", stdout);
+	}
+	if(8 > g->block_pointer_size)
+	{
+		/* Everything before the first volume block and the superblock after
+		 * the planned blocks need addresses too
+		 */
+		ensure(g, 0 == ((first_volume_block(g) + volume_blocks_needed + 1) >> (g->block_pointer_size << 3)), "too many blocks for the selected --block-pointer-size\n");
+	}
+
+	/* Everything up to and including the superblock */
+	g->image_size = (first_volume_block(g) + volume_blocks_needed + 1) * g->volume_block_size;
+	if(NULL != g->output_buffer)
+	{
+		if(g->image_size > g->output_capacity) return;
+		/* Whatever sits between the leadblock and the first block stays zero */
+		memset(g->output_buffer, 0, g->image_size);
+	}
+
+	/* Write the MBR which is always the first sector */
+	write_MBR(g);
+
+	/* Write our leadblock which is always the second sector */
+	write_leadblock(g, volume_blocks_needed);
+
+	/* Then everything else from the bottom up */
+	write_filesystem(g, volume_blocks_needed);
+
+	/* Make sure it actually hit the disk */
+	if(0 <= g->write_fd)
+	{
+		start = stats_start(g);
+		fsync(g->write_fd);
+		stats_stop(g, STAT_PHASE_FSYNC, start);
+	}
+}
+
+/* Whatever build_image() had going when it finished or failed */
+void finish_build(struct gfk* g)
+{
+	prefetch_stop(g);
+	pool_stop(g);
+	external_free(g);
+	free_writer(g);
+	free_buffers(g->allocated);
+	g->allocated = NULL;
+	if((NULL != g->output_name) && (0 <= g->write_fd)) close(g->write_fd);
+	g->write_fd = -1;
+}
+
+long gfk_build(struct gfk* g)
+{
+	jmp_buf here;
+	jmp_buf* outer = unwind;
+	/* What auto geometry and the output pick only holds for this build */
+	int native_block_size = g->native_block_size;
+	int volume_block_size = g->volume_block_size;
+	int block_pointer_size = g->block_pointer_size;
+	int checksum_size = g->checksum_size;
+	int direct_mode = g->direct_mode;
+
+	forget_error(g);
+	g->image_size = 0;
+	g->buffer_alignment = 0;
+	unwind = &here;
+	if(0 == setjmp(here))
+	{
+		if(NULL != g->output_name)
+		{
+			open_output(g, g->output_name);
+		}
+		else if(NULL != g->output_buffer)
+		{
+			setup_output_buffer(g);
+		}
+		else
+		{
+			ensure(g, 0 <= g->output_fd, "You must set an --output file\n");
+			if(g->output_truncate) ensure(g, 0 == ftruncate(g->output_fd, 0), "unable to empty the output memfd\n");
+			/* Somebody else opened it so O_DIRECT is their call */
+			g->direct_mode = FALSE;
+			setup_output(g, g->output_fd);
+		}
+		build_image(g);
+	}
+	unwind = outer;
+	finish_build(g);
+
+	g->native_block_size = native_block_size;
+	g->volume_block_size = volume_block_size;
+	g->block_pointer_size = block_pointer_size;
+	g->checksum_size = checksum_size;
+	g->direct_mode = direct_mode;
+	if(g->failed) return -1;
+	if((NULL != g->output_buffer) && (g->image_size > g->output_capacity)) return -1;
+	return g->image_size;
+}
+
+long gfk_image_size(struct gfk* g)
+{
+	return g->image_size;
+}
@@ -17,41 +17,47 @@
 
 #include "gfk_create.h"
 
-int disk_block_count;
-int native_block_size;
-int volume_block_size;
-int inode_size;
-int dnode_size;
-int checksum_mode;
-int checksum_size;
-int block_pointer_size;
-int file_size_size;
-FILE* output;
-
-int _volume_block_id;
-int get_free_block()
+long get_free_block(struct gfk* g)
 {
-	int r = _volume_block_id;
-	_volume_block_id = _volume_block_id + 1;
+	long r = g->next_block;
+	g->next_block = g->next_block + 1;
 	return r;
 }
 
-int folders_count(struct folders* a)
+/* Reserve a run of count blocks, returning the first */
+long get_free_blocks(struct gfk* g, long count)
 {
-	if(NULL == a) return 0;
-	return 1 + folders_count(a->next);
+	long r = g->next_block;
+	g->next_block = g->next_block + count;
+	return r;
 }
 
-int files_count(struct files* a)
+long folders_count(struct folders* a)
 {
-	if(NULL == a) return 0;
-	return 1 + files_count(a->next);
+	long count = 0;
+	while(NULL != a)
+	{
+		count = count + 1;
+		a = a->next;
+	}
+	return count;
 }
 
-int max_inodes()
+long files_count(struct files* a)
 {
-	int max = volume_block_size / inode_size;
-	if(0 == (volume_block_size % inode_size))
+	long count = 0;
+	while(NULL != a)
+	{
+		count = count + 1;
+		a = a->next;
+	}
+	return count;
+}
+
+int max_inodes(struct gfk* g)
+{
+	int max = g->volume_block_size / g->inode_size;
+	if(0 == (g->volume_block_size % g->inode_size))
 	{
 		/* if packing too tight */
 		max = max - 1;
@@ -59,10 +65,10 @@ int max_inodes()
 	return max;
 }
 
-int max_dnodes()
+int max_dnodes(struct gfk* g)
 {
-	int max = volume_block_size / dnode_size;
-	if(0 == (volume_block_size % inode_size))
+	int max = g->volume_block_size / g->dnode_size;
+	if(0 == (g->volume_block_size % g->dnode_size))
 	{
 		/* if packing too tight */
 		max = max - 1;
@@ -70,264 +76,346 @@ int max_dnodes()
 	return max;
 }
 
-int blocks_needed_for_file_data(int size)
+long divide_round_up(long count, long per_block)
 {
-	int count = (size / volume_block_size);
-	if(0 != (size % volume_block_size))
+	long blocks = count / per_block;
+	if(0 != (count % per_block))
 	{
 		/* Round up */
-		count = count + 1;
+		blocks = blocks + 1;
 	}
-	return count;
+	return blocks;
 }
 
-int blocks_needed_for_file(int size)
+long blocks_needed_for_file_data(struct gfk* g, long size)
 {
-	int count = blocks_needed_for_file_data(size);
-
-	/* Deal with the simplest case */
-	if(count < max_inodes()) return count + 1;
-
-	/* One leve of indirection (plenty for the default sizes)*/
-	int max_single_indirect_inodes = max_inodes() * max_inodes();
-	require(0 < max_single_indirect_inodes, "This tool currently doesn't support files exceeding 1GB in size\n");
-
-	int direct_blocks = count / max_inodes();
-	if(0 != (count % max_inodes()))
-	{
-		/* make sure we have enough direct blocks */
-		direct_blocks = direct_blocks + 1;
-	}
-
-	if(count < max_single_indirect_inodes) return count + direct_blocks + 1;
-
-
-	/* Second level of hello */
-	int max_double_indirect_inodes = max_inodes() * max_single_indirect_inodes;
-	require(0 < max_double_indirect_inodes, "This tool currently doesn't support files exceeding 1GB in size\n");
+	return divide_round_up(size, g->volume_block_size);
+}
 
-	int level_zero_indirect_blocks = count / max_single_indirect_inodes;
-	if(0 != (count % max_single_indirect_inodes))
+/* Every block above the bottom level is an indirect block holding max_inodes() pointers
+ * so we just keep dividing until we reach the single root block; O(log n) in the size.
+ */
+long indirect_blocks_needed(struct gfk* g, long bottom)
+{
+	long total = 0;
+	long level = bottom;
+	while(1 < level)
 	{
-		/* make sure we have enough level zero indirect blocks */
-		level_zero_indirect_blocks = level_zero_indirect_blocks + 1;
+		level = divide_round_up(level, max_inodes(g));
+		total = total + level;
 	}
-
-	if(count < max_double_indirect_inodes) return count + direct_blocks + level_zero_indirect_blocks + 1;
-
-	fputs("TODO inode indirection expansion\n", stderr);
-	exit(EXIT_FAILURE);
+	return total;
 }
 
-int blocks_needed_for_files(struct files* a)
+/* The file blocks pointing at count data blocks, even an empty file gets one */
+long file_blocks_needed(struct gfk* g, long count)
 {
-	if(NULL == a) return 0;
-	a->blocks_needed = blocks_needed_for_file(a->size);
-	return a->blocks_needed + blocks_needed_for_files(a->next);
+	long file_blocks = divide_round_up(count, max_inodes(g));
+	if(0 == file_blocks) return 1;
+	return file_blocks;
 }
 
-int blocks_needed_for_folders(struct folders* a)
+/* The directory blocks holding the dnodes, even an empty folder gets one */
+long directory_blocks_needed(struct gfk* g, long dnodes)
 {
-	if(NULL == a) return 0;
-	int dnodes_needed = files_count(a->f) + folders_count(a->sub);
-
-	/* How many do we need? */
-	int max_single_indirect_dnodes = max_dnodes() * max_inodes();
-	require(0 < max_single_indirect_dnodes, "The folder is way bigger than it needs to be\n");
-
+	long directory_blocks = divide_round_up(dnodes, max_dnodes(g));
+	if(0 == directory_blocks) return 1;
+	return directory_blocks;
+}
 
-	/* Deal with simple case of single direct block */
-	if(dnodes_needed < max_dnodes())
+/* Next fit within a folder; returns how many new packed blocks placing the tail took */
+long pack_tail(struct gfk* g, long* used, long tail)
+{
+	if((0 != *used) && ((*used + tail) <= g->volume_block_size))
 	{
-		a->blocks_needed = 1;
+		*used = *used + tail;
+		return 0;
 	}
-	else if(dnodes_needed < max_single_indirect_dnodes)
+	*used = tail;
+	g->stats.packed_blocks = g->stats.packed_blocks + 1;
+	return 1;
+}
+
+/* packed is the tail packing state of the folder the file is in, NULL if not packing */
+long blocks_needed_for_file(struct gfk* g, long size, long* packed)
+{
+	long count = blocks_needed_for_file_data(g, size);
+	long pointers = count;
+	long packed_blocks = 0;
+
+	if(8 > g->file_size_size)
 	{
-		a->blocks_needed = (dnodes_needed / max_dnodes()) + 1;
-		if(0 != (dnodes_needed % max_dnodes()))
-		{
-			a->blocks_needed = a->blocks_needed + 1;
-		}
+		ensure(g, 0 == (size >> (g->file_size_size << 3)), "file is too big for the selected --file-size-block-size\n");
 	}
-	else
+
+	if((NULL != packed) && (0 != (size % g->volume_block_size)))
 	{
-		fputs("TODO expand dnode indirection\n", stderr);
-		exit(EXIT_FAILURE);
+		/* The tail leaves its own block but needs an inode plus its offset */
+		count = count - 1;
+		pointers = count + 2;
+		packed_blocks = pack_tail(g, packed, size % g->volume_block_size);
 	}
 
-	return a->blocks_needed + blocks_needed_for_folders(a->sub) + blocks_needed_for_files(a->f);
+	long file_blocks = file_blocks_needed(g, pointers);
+	long indirect = indirect_blocks_needed(g, file_blocks);
+
+	g->stats.data_blocks = g->stats.data_blocks + count;
+	g->stats.file_blocks = g->stats.file_blocks + file_blocks;
+	g->stats.indirect_file_blocks = g->stats.indirect_file_blocks + indirect;
+	g->stats.name_blocks = g->stats.name_blocks + 1;
+	return 1 + count + file_blocks + indirect + packed_blocks;
 }
 
-void write_sector(char* s, int size)
+long blocks_needed_for_files(struct gfk* g, struct files* a)
 {
-	fwrite(s, sizeof(char), size, output);
-	fflush(output);
+	long total = 0;
+	long used = 0;
+	long* packed = NULL;
+	if(g->pack_tails) packed = &used;
+	while(NULL != a)
+	{
+		a->blocks_needed = blocks_needed_for_file(g, a->size, packed);
+		total = total + a->blocks_needed;
+		a = a->next;
+	}
+	return total;
 }
 
-void write_block(char* s, int size)
+long blocks_needed_for_folders(struct gfk* g, struct folders* a)
 {
-	int needed = (size / native_block_size);
-	if(0 != (volume_block_size / native_block_size))
+	long total = 0;
+	while(NULL != a)
 	{
-		needed = needed + 1;
+		long dnodes_needed = files_count(a->f) + folders_count(a->sub);
+
+		long directory_blocks = directory_blocks_needed(g, dnodes_needed);
+		long indirect = indirect_blocks_needed(g, directory_blocks);
+		a->blocks_needed = directory_blocks + indirect;
+
+		g->stats.directory_blocks = g->stats.directory_blocks + directory_blocks;
+		g->stats.indirect_directory_blocks = g->stats.indirect_directory_blocks + indirect;
+
+		/* Every sub folder's name is a block in here too */
+		total = total + folders_count(a->sub);
+		g->stats.name_blocks = g->stats.name_blocks + folders_count(a->sub);
+
+		total = total + a->blocks_needed + blocks_needed_for_folders(g, a->sub) + blocks_needed_for_files(g, a->f);
+		a = a->next;
 	}
+	return total;
+}
 
-	struct buffers* a;
+long checksum_block(struct gfk* g, char* block)
+{
+	if(0 == g->checksum_size) return 0;
+	long start = stats_start(g);
+	long mask = (1L << g->checksum_size) - 1;
+	long checksum = 0;
 	int i = 0;
-	while( i <= needed)
+	char ch;
+
+	/* BSD checksum exactly as the standard spells it out */
+	while(i < g->volume_block_size)
 	{
-		a = create_buffer(allocated, native_block_size);
-		memcpy(a->buffer, s + (i * native_block_size), native_block_size);
-		write_sector(a->buffer, native_block_size);
-		remove_buffer(a);
-		i = i + 1;
+		ch = block[i];
+		checksum = (checksum >> 1) + ((checksum & 1) << 15);
+		checksum += ch;
+		checksum &= mask;
+		i += 1;
 	}
+	stats_stop(g, STAT_PHASE_CHECKSUM, start);
+	return checksum;
 }
 
-void insert_block_address(char* a, int address)
+/* Checksum a finished block, put it in its place in the volume and hand back
+ * the inode pointing at it; the block comes back zeroed for reuse
+ */
+void emit_block(struct gfk* g, char* block, long address, struct inode* out)
 {
-	if(block_pointer_size > 1)
+	out->address = address;
+	out->checksum = checksum_block(g, block);
+	write_at(g, block, g->volume_block_size, address * g->volume_block_size);
+	memset(block, 0, g->volume_block_size);
 }
 
-void insert_inode(struct buffers* a, int index, int address, int checksum)
+void write_name_block(struct gfk* g, char* name, long address, char* block, struct inode* out)
 {
+	ensure(g, (long)strlen(name) < g->volume_block_size, "file names must be shorter than the volume block size\n");
+	strcpy(block, name);
+	emit_block(g, block, address, out);
 }
 
-void read_write_direct_file_blocks(FILE* f, struct buffers* b)
+/* Keep stacking indirect blocks over the count blocks in level until a single
+ * one is left; they take the addresses from address on, level is consumed
+ */
+void write_indirect_levels(struct gfk* g, struct inode* level, long count, long address, int tag, char* block, struct inode* root)
 {
-}
+	int per = max_inodes(g);
+	struct inode* above;
+	long blocks;
+	long i;
+	long n;
 
-void read_write_indirect_file_blocks(struct files* f, struct buffers* b)
-{
-	if(f->blocks_needed <= (max_inodes() * max_inodes()))
+	while(1 < count)
 	{
-		/* only a single indirection block needed */
-	}
-	else
-	{
-		fputs("read_write_indirect_file_blocks doesn't support this yet\n", stderr);
-		exit(EXIT_FAILURE);
+		blocks = divide_round_up(count, per);
+		above = calloc(blocks, sizeof(struct inode));
+		ensure(g, NULL != above, "calloc failed in write_indirect_levels\n");
+		i = 0;
+		while(i < blocks)
+		{
+			n = count - (i * per);
+			if(n > per) n = per;
+			block[0] = tag;
+			g->encode_inodes(g, block + 1, level + (i * per), n);
+			emit_block(g, block, address, above + i);
+			address = address + 1;
+			i = i + 1;
+		}
+		free(level);
+		level = above;
+		count = blocks;
 	}
+	*root = level[0];
+	free(level);
 }
 
-int read_write_file_blocks(struct files* f)
+void write_directory_blocks(struct gfk* g, struct dnode* dnodes, long count, long address, char* block, struct inode* root)
 {
-	if(f->blocks_needed <= max_inodes())
-	{
-		/* First write the data to disk */
-		read_write_direct_file_blocks(f->f);
-	}
-	else
+	int per = max_dnodes(g);
+	long blocks = directory_blocks_needed(g, count);
+	struct inode* level = calloc(blocks, sizeof(struct inode));
+	ensure(g, NULL != level, "calloc failed in write_directory_blocks\n");
+	long i = 0;
+	long n;
+
+	while(i < blocks)
 	{
-		read_write_indirect_file_blocks(f);
+		n = count - (i * per);
+		if(n > per) n = per;
+		block[0] = FOLDER_TAGE;
+		g->encode_dnodes(g, block + 1, dnodes + (i * per), n);
+		emit_block(g, block, address + i, level + i);
+		i = i + 1;
 	}
-	return get_free_block();
+	write_indirect_levels(g, level, blocks, address + blocks, FOLDER_INDIRECT_TAG, block, root);
 }
 
-void write_MBR()
+void write_MBR(struct gfk* g)
 {
-	struct buffers* a = create_buffer(allocated, native_block_size);
-	if(NULL != MBR)
-	{
-		FILE* f = fopen(MBR, "r");
-		require(NULL != f, "Unable to open MBR file for reading\n");
-		int read = fread(a->buffer, sizeof(char) ,native_block_size, f);
-		require(read > 0, "empty MBRs are not supported\n");
-		write_sector(a->buffer, native_block_size);
-		remove_buffer(a);
-
-		a = create_buffer(allocated, native_block_size);
-		read = fread(a->buffer, sizeof(char) ,native_block_size, f);
-		require(0 == read, "MBR is not allowed to be bigger than a single sector\n");
-	}
-	else
+	struct buffers* a = create_buffer(g, g->allocated, g->native_block_size);
+	if(NULL != g->MBR)
 	{
-		/* Deal with NULL case */
-		write_sector(a->buffer, native_block_size);
+		FILE* f = fopen(g->MBR, "r");
+		ensure(g, NULL != f, "Unable to open MBR file for reading\n");
+		long start = stats_start(g);
+		int read = fread(a->buffer, sizeof(char) ,g->native_block_size, f);
+		stats_stop(g, STAT_PHASE_READ, start);
+		g->stats.bytes_read = g->stats.bytes_read + read;
+		/* Anything past the first sector would be lost */
+		int more = fgetc(f);
+		fclose(f);
+		ensure(g, read > 0, "empty MBRs are not supported\n");
+		ensure(g, EOF == more, "MBR is not allowed to be bigger than a single sector\n");
 	}
-	remove_buffer(a);
+	/* Without one it is just a sector of zeros */
+	write_at(g, a->buffer, g->native_block_size, 0);
+	remove_buffer(g, a);
 }
 
-void write_slice(char* buffer, int value)
+void write_slice(struct gfk* g, char* buffer, long value)
 {
 	/* Currently does the wrong thing for little bit endian but oh well */
-	if(BigByteEndian)
-	{
-		buffer[4] = (value & 0xFF000000) >> 24;
-		buffer[5] = (value & 0xFF0000) >> 16;
-		buffer[6] = (value & 0xFF00) >> 8;
-		buffer[7] = value & 0xFF;
-	}
-	else
-	{
-		buffer[0] = value & 0xFF;
-		buffer[1] = (value & 0xFF00) >> 8;
-		buffer[2] = (value & 0xFF0000) >> 16;
-		buffer[3] = (value & 0xFF000000) >> 24;
-	}
+	g->put_slice(buffer, value);
 }
 
-void write_leadblock()
+/* Piece 1 of the superblock */
+long feature_flags(struct gfk* g)
 {
-	struct buffers* a = create_buffer(allocated, native_block_size);
-	char encoding_flag = 0;
-	if(!BigByteEndian) encoding_flag = encoding_flag | 0b10000000;
-	if(!BigBitEndian)  encoding_flag = encoding_flag |  0b1000000;
-
-	/* We only support version zero thus far so rest of encoding flag must be zero */
-	a->buffer[0] = encoding_flag;
-
-	/* store size of blocks */
-	write_slice(a->buffer+64, volume_block_size);
-
-	/* store size of block pointer */
-	write_slice(a->buffer+128, block_pointer_size);
-
-	/* store size of file size */
-	write_slice(a->buffer+192, file_size_size);
+	long flags = 0;
+	if(0 != g->checksum_mode) flags = flags | FEATURE_CHECKSUM;
+	if(g->pack_tails) flags = flags | FEATURE_PACKED_TAILS;
+	return flags;
+}
 
-	/* store superblock address */
-	int volume_blocks_needed = blocks_needed_for_folders(filesystem);
-	if(native_block_size > volume_block_size)
+/* The first volume block after the MBR and the leadblock */
+long first_volume_block(struct gfk* g)
+{
+	long first;
+	if(g->native_block_size > g->volume_block_size)
 	{
-		_volume_block_id = ((native_block_size << 1) / volume_block_size);
 		/* Figure out which virtual block address physical block address is */
-		volume_blocks_needed = volume_blocks_needed + _volume_block_id;
-		if(0 != ((native_block_size << 1) % volume_block_size))
+		first = ((g->native_block_size << 1) / g->volume_block_size);
+		if(0 != ((g->native_block_size << 1) % g->volume_block_size))
 		{
 			/* fudge the extra block */
-			volume_blocks_needed = volume_blocks_needed + 1;
-			_volume_block_id = _volume_block_id + 1;
+			first = first + 1;
 		}
 		/* the block after the leadblock is the one we start allocating in */
-		_volume_block_id = _volume_block_id + 1;
+		first = first + 1;
 	}
 	else
 	{
 		/* Deal with the case the native block size is equal or smaller than virtual block size */
-		if((native_block_size < 1) <= volume_block_size)
+		if((g->native_block_size < 1) <= g->volume_block_size)
 		{
-			volume_blocks_needed = volume_blocks_needed + 1;
 			/* Looks like the block after the leadblock is volume address 2 */
-			_volume_block_id = 2;
+			first = 2;
 		}
 		else
 		{
-			volume_blocks_needed = volume_blocks_needed + 2;
 			/* Looks like the block after the leadblock is volume address 3 */
-			_volume_block_id = 3;
+			first = 3;
 		}
 	}
-	write_slice(a->buffer+256, volume_blocks_needed);
+	return first;
+}
+
+void write_leadblock(struct gfk* g, long volume_blocks_needed)
+{
+	struct buffers* a = create_buffer(g, g->allocated, g->native_block_size);
+	char encoding_flag = 0;
+	if(!g->BigByteEndian) encoding_flag = encoding_flag | 0b10000000;
+	if(!g->BigBitEndian)  encoding_flag = encoding_flag |  0b1000000;
+
+	/* We only support version zero thus far so rest of encoding flag must be zero */
+	a->buffer[0] = encoding_flag;
+
+	/* store size of blocks */
+	write_slice(g, a->buffer+64, g->volume_block_size);
+
+	/* store size of block pointer */
+	write_slice(g, a->buffer+128, g->block_pointer_size);
+
+	/* store size of file size */
+	write_slice(g, a->buffer+192, g->file_size_size);
+
+	/* store superblock address */
+	g->next_block = first_volume_block(g);
+	/* Which is right after everything we planned */
+	write_slice(g, a->buffer+256, g->next_block + volume_blocks_needed);
 
 	/* store native block size */
-	write_slice(a->buffer+320, native_block_size);
+	write_slice(g, a->buffer+320, g->native_block_size);
 
 	/* The result needs to be nulls*/
 
 	/* Now write it out to disk */
-	write_sector(a->buffer, native_block_size);
+	write_at(g, a->buffer, g->native_block_size, g->native_block_size);
 
 	/* clean up after ourselves */
-	remove_buffer(a);
+	remove_buffer(g, a);
+}
+
+/* The last block of the volume; everything but the header follows the encoding flags */
+void write_superblock(struct gfk* g, struct inode* root)
+{
+	struct buffers* a = create_buffer(g, g->allocated, g->volume_block_size);
+	memcpy(a->buffer, "KNIGHT!\n", 8);
+	write_slice(g, a->buffer+8, feature_flags(g));
+	write_slice(g, a->buffer+16, g->checksum_mode);
+	write_slice(g, a->buffer+24, g->checksum_size);
+	write_slice(g, a->buffer+32, root->address);
+	write_at(g, a->buffer, g->volume_block_size, get_free_block(g) * g->volume_block_size);
+	remove_buffer(g, a);
 }
@@ -17,34 +17,46 @@
 
 #include "gfk_create.h"
 
-struct buffers* allocated;
-
-struct buffers* allocate_buffer(int size)
+struct buffers* allocate_buffer(struct gfk* g, int size)
 {
 	struct buffers* a = calloc(1, sizeof(struct buffers));
-	require(NULL != a, "Buffer allocation failed\n");
-	a->buffer = calloc(size+4, sizeof(char));
-	require(NULL != a->buffer, "Buffer allocation failed\n");
+	ensure(g, NULL != a, "Buffer allocation failed\n");
+	if(0 != g->buffer_alignment)
+	{
+		/* O_DIRECT wants sector aligned memory */
+		void* hold = NULL;
+		if(0 != posix_memalign(&hold, g->buffer_alignment, size+g->buffer_alignment)) hold = NULL;
+		a->buffer = hold;
+		if(NULL != a->buffer) memset(a->buffer, 0, size+g->buffer_alignment);
+	}
+	else
+	{
+		a->buffer = calloc(size+4, sizeof(char));
+	}
+	if(NULL == a->buffer) free(a);
+	ensure(g, NULL != a->buffer, "Buffer allocation failed\n");
 	a->CLEANED = TRUE;
 	a->IN_USE = FALSE;
 	a->size = size;
+	__atomic_add_fetch(&g->stats.buffer_allocations, 1, __ATOMIC_RELAXED);
 	return a;
 }
 
-struct buffers* create_buffer(struct buffers* a, int size)
+struct buffers* create_buffer(struct gfk* g, struct buffers* a, int size)
 {
 	if(NULL == a)
 	{
-		a = allocate_buffer(size);
+		a = allocate_buffer(g, size);
 	}
 
 	if(a->CLEANED && !a->IN_USE && (a->size >= size))
 	{
 		a->IN_USE = TRUE;
+		stats_buffer_taken(g);
 		return a;
 	}
 
-	struct buffers* hold = create_buffer(a->next, size);
+	struct buffers* hold = create_buffer(g, a->next, size);
 
 	if(NULL == a->next)
 	{
@@ -54,7 +66,20 @@ struct buffers* create_buffer(struct buffers* a, int size)
 	return hold;
 }
 
-void remove_buffer(struct buffers* a)
+/* Hand a whole list back once the image it was for is done */
+void free_buffers(struct buffers* a)
+{
+	struct buffers* next;
+	while(NULL != a)
+	{
+		next = a->next;
+		free(a->buffer);
+		free(a);
+		a = next;
+	}
+}
+
+void remove_buffer(struct gfk* g, struct buffers* a)
 {
 	/* Clean the buffer */
 	memset(a->buffer, 0, a->size);
@@ -63,4 +88,5 @@ void remove_buffer(struct buffers* a)
 	/* Reset for next use */
 	a->checksum = 0;
 	a->IN_USE = FALSE;
+	stats_buffer_returned(g);
 }
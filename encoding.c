@@ -0,0 +1,212 @@
+/* Copyright (C) 2022 Jeremiah Orians
+ * This file is part of GFK
+ *
+ * GFK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GFK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GFK If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gfk_create.h"
+
+/* select_encoders() hands every builder single field stores, for the leadblock
+ * and the rare dnode layouts the whole array encoders below don't cover, and the
+ * whole array encoders so nothing else branches on widths or endianness
+ */
+
+/* A memcpy of a fixed size compiles down to a single (unaligned) store, even
+ * without optimization; a width of zero is a field that is switched off
+ */
+#define STORE_0_native(s, value) do {} while(0)
+#define STORE_0_swapped(s, value) do {} while(0)
+#define STORE_2_native(s, value) do { unsigned short v_ = (value); memcpy((s), &v_, 2); } while(0)
+#define STORE_2_swapped(s, value) do { unsigned short v_ = __builtin_bswap16(value); memcpy((s), &v_, 2); } while(0)
+#define STORE_4_native(s, value) do { unsigned int v_ = (value); memcpy((s), &v_, 4); } while(0)
+#define STORE_4_swapped(s, value) do { unsigned int v_ = __builtin_bswap32(value); memcpy((s), &v_, 4); } while(0)
+#define STORE_8_native(s, value) do { unsigned long long v_ = (value); memcpy((s), &v_, 8); } while(0)
+#define STORE_8_swapped(s, value) do { unsigned long long v_ = __builtin_bswap64(value); memcpy((s), &v_, 8); } while(0)
+
+void put_nothing(char* s, unsigned long value)
+{
+	(void)s;
+	(void)value;
+}
+
+void put16_native(char* s, unsigned long value)
+{
+	STORE_2_native(s, value);
+}
+
+void put16_swapped(char* s, unsigned long value)
+{
+	STORE_2_swapped(s, value);
+}
+
+void put32_native(char* s, unsigned long value)
+{
+	STORE_4_native(s, value);
+}
+
+void put32_swapped(char* s, unsigned long value)
+{
+	STORE_4_swapped(s, value);
+}
+
+void put64_native(char* s, unsigned long value)
+{
+	STORE_8_native(s, value);
+}
+
+void put64_swapped(char* s, unsigned long value)
+{
+	STORE_8_swapped(s, value);
+}
+
+/* One loop per block pointer width, checksum width and byte order; every
+ * offset and stride is a constant so each field is a plain or byteswapped move
+ * the compiler is free to unroll and vectorize. dnodes carry the 64bit file
+ * size the standard mandates.
+ */
+#define ENCODERS(POINTER, CHECKSUM, ORDER) \
+void encode_inodes_##POINTER##_##CHECKSUM##_##ORDER(struct gfk* g, char* s, struct inode* in, int count) \
+{ \
+	int i = 0; \
+	(void)g; \
+	while(i < count) \
+	{ \
+		STORE_##POINTER##_##ORDER(s, in[i].address); \
+		STORE_##CHECKSUM##_##ORDER(s + POINTER, in[i].checksum); \
+		s = s + POINTER + CHECKSUM; \
+		i = i + 1; \
+	} \
+} \
+void encode_dnodes_##POINTER##_##CHECKSUM##_##ORDER(struct gfk* g, char* s, struct dnode* in, int count) \
+{ \
+	int i = 0; \
+	(void)g; \
+	while(i < count) \
+	{ \
+		STORE_##POINTER##_##ORDER(s, in[i].name.address); \
+		STORE_##CHECKSUM##_##ORDER(s + POINTER, in[i].name.checksum); \
+		STORE_##POINTER##_##ORDER(s + POINTER + CHECKSUM, in[i].contents.address); \
+		STORE_##CHECKSUM##_##ORDER(s + (POINTER << 1) + CHECKSUM, in[i].contents.checksum); \
+		STORE_8_##ORDER(s + ((POINTER + CHECKSUM) << 1), in[i].size); \
+		s = s + ((POINTER + CHECKSUM) << 1) + 8; \
+		i = i + 1; \
+	} \
+}
+
+#define ENCODER_ORDERS(POINTER, CHECKSUM) \
+ENCODERS(POINTER, CHECKSUM, native) \
+ENCODERS(POINTER, CHECKSUM, swapped)
+
+#define ENCODER_CHECKSUMS(POINTER) \
+ENCODER_ORDERS(POINTER, 0) \
+ENCODER_ORDERS(POINTER, 2) \
+ENCODER_ORDERS(POINTER, 4) \
+ENCODER_ORDERS(POINTER, 8)
+
+ENCODER_CHECKSUMS(2)
+ENCODER_CHECKSUMS(4)
+ENCODER_CHECKSUMS(8)
+
+struct encoders
+{
+	int pointer;
+	int checksum;
+	int swap;
+	void (*inodes)(struct gfk* g, char* s, struct inode* in, int count);
+	void (*dnodes)(struct gfk* g, char* s, struct dnode* in, int count);
+};
+
+#define ENCODER_ENTRY(POINTER, CHECKSUM, ORDER, SWAP) \
+{POINTER, CHECKSUM, SWAP, encode_inodes_##POINTER##_##CHECKSUM##_##ORDER, encode_dnodes_##POINTER##_##CHECKSUM##_##ORDER}
+
+#define ENCODER_ENTRIES(POINTER) \
+ENCODER_ENTRY(POINTER, 0, native, FALSE), ENCODER_ENTRY(POINTER, 0, swapped, TRUE), \
+ENCODER_ENTRY(POINTER, 2, native, FALSE), ENCODER_ENTRY(POINTER, 2, swapped, TRUE), \
+ENCODER_ENTRY(POINTER, 4, native, FALSE), ENCODER_ENTRY(POINTER, 4, swapped, TRUE), \
+ENCODER_ENTRY(POINTER, 8, native, FALSE), ENCODER_ENTRY(POINTER, 8, swapped, TRUE)
+
+#define ENCODER_COUNT 24
+const struct encoders specialized[ENCODER_COUNT] = {ENCODER_ENTRIES(2), ENCODER_ENTRIES(4), ENCODER_ENTRIES(8)};
+
+/* For dnodes with a file size field other than 64bits; one call per field */
+void encode_dnodes_generic(struct gfk* g, char* s, struct dnode* in, int count)
+{
+	int pointer = g->block_pointer_size;
+	int node = g->inode_size;
+	int stride = g->dnode_size;
+	int i = 0;
+	while(i < count)
+	{
+		g->put_address(s, in[i].name.address);
+		g->put_checksum(s + pointer, in[i].name.checksum);
+		g->put_address(s + node, in[i].contents.address);
+		g->put_checksum(s + node + pointer, in[i].contents.checksum);
+		g->put_file_size(s + (node << 1), in[i].size);
+		s = s + stride;
+		i = i + 1;
+	}
+}
+
+typedef void (*store)(char* s, unsigned long value);
+
+int swapping(struct gfk* g)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return !g->BigByteEndian;
+#else
+	return g->BigByteEndian;
+#endif
+}
+
+store pick_store(struct gfk* g, int bytes, char* what)
+{
+	int swap = swapping(g);
+	char message[96];
+
+	if(0 == bytes) return put_nothing;
+	if(2 == bytes) return swap ? put16_swapped : put16_native;
+	if(4 == bytes) return swap ? put32_swapped : put32_native;
+	if(8 == bytes) return swap ? put64_swapped : put64_native;
+
+	strcpy(message, "unsupported ");
+	strcat(message, what);
+	strcat(message, " size: ");
+	strcat(message, int2str(bytes, 10, FALSE));
+	strcat(message, " bytes\n");
+	fail(g, message);
+	return NULL;
+}
+
+void select_encoders(struct gfk* g)
+{
+	int swap = swapping(g);
+	int i = 0;
+
+	g->put_address = pick_store(g, g->block_pointer_size, "block pointer");
+	g->put_checksum = pick_store(g, g->checksum_size / 8, "checksum");
+	g->put_file_size = pick_store(g, g->file_size_size, "file size");
+	g->put_slice = pick_store(g, 8, "leadblock field");
+
+	/* pick_store() already turned away every width we don't have a loop for */
+	while(i < ENCODER_COUNT)
+	{
+		if((specialized[i].pointer == g->block_pointer_size) && (specialized[i].checksum == (g->checksum_size / 8)) && (specialized[i].swap == swap))
+		{
+			g->encode_inodes = specialized[i].inodes;
+			g->encode_dnodes = specialized[i].dnodes;
+		}
+		i = i + 1;
+	}
+	if(8 != g->file_size_size) g->encode_dnodes = encode_dnodes_generic;
+}
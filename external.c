@@ -0,0 +1,793 @@
+/* Copyright (C) 2022 Jeremiah Orians
+ * This file is part of GFK
+ *
+ * GFK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GFK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GFK If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gfk_create.h"
+
+/* With --max-memory we never build struct files/struct folders; entries are
+ * buffered up to the limit, sorted, spilled to temporary run files and then
+ * merged back into a single stream in tree order which the planner and then
+ * the writer walk with nothing more than a stack of the directories currently open.
+ */
+struct entry
+{
+	char* path;
+	long size;
+};
+
+/* A sorted run is just a stretch of the single spill file */
+struct runs
+{
+	long offset;
+	long end;
+	char* buffer;
+	int used;
+	int filled;
+	struct entry head;
+	struct runs* next;
+};
+
+#define RUN_BUFFER 16384
+
+/* The folders currently open on the path we are walking; index 0 is root */
+struct open_folder
+{
+	char* name;
+	long index;
+	long dnodes;
+	long packed;
+	/* Only used while writing */
+	long address;
+	long blocks;
+	struct dnode* pending;
+	int pending_count;
+	struct inode* level;
+	long level_capacity;
+};
+
+struct external
+{
+	/* Entries not yet spilled, and the runs that were */
+	struct entry* pending;
+	long pending_count;
+	long pending_capacity;
+	long pending_bytes;
+	FILE* spill;
+	struct runs* spilled;
+	long run_count;
+
+	/* A min-heap of run heads keyed on tree_compare */
+	struct runs** heap;
+	long heap_count;
+
+	struct open_folder* stack;
+	int stack_depth;
+	int stack_capacity;
+
+	/* The planner leaves the merged stream and the size of every folder (in the
+	 * order they are opened) behind for the writer, which needs them up front
+	 */
+	struct runs* tree;
+	FILE* folder_sizes;
+	long folder_count;
+	long folder_blocks;
+
+	/* The writer's side of things */
+	struct buffers* directory_block;
+	struct files** done_files;
+	long done_count;
+	long done_capacity;
+};
+
+/* The order write_folder_data() visits files in: folders depth first with a
+ * '/' sorting before anything else so everything inside a folder stays
+ * together (a/b/x < a/b-c/y), and a folder's own files before its sub folders
+ */
+int tree_compare(char* a, char* b)
+{
+	char* end_a = strrchr(a, '/');
+	char* end_b = strrchr(b, '/');
+	char* name_a = a;
+	char* name_b = b;
+	int x;
+	int y;
+	if(NULL == end_a) end_a = a;
+	else name_a = end_a + 1;
+	if(NULL == end_b) end_b = b;
+	else name_b = end_b + 1;
+
+	while(TRUE)
+	{
+		x = 0;
+		y = 0;
+		if(a < end_a) x = (unsigned char)a[0];
+		if(b < end_b) y = (unsigned char)b[0];
+		if('/' == x) x = 1;
+		if('/' == y) y = 1;
+		if(x != y) return x - y;
+		if(0 == x) return strcmp(name_a, name_b);
+		a = a + 1;
+		b = b + 1;
+	}
+}
+
+int entry_compare(const void* a, const void* b)
+{
+	return tree_compare(((struct entry*)a)->path, ((struct entry*)b)->path);
+}
+
+/* Drop the "." folders the same way put_in_folders() does */
+char* normalize_path(struct gfk* g, char* s)
+{
+	char* r = calloc(strlen(s) + 1, sizeof(char));
+	ensure(g, NULL != r, "calloc failed in normalize_path\n");
+	char* last = strrchr(s, '/');
+	char* out = r;
+	char* component = s;
+	char* end;
+	int size;
+
+	while((NULL != last) && (component <= last))
+	{
+		end = strchr(component, '/');
+		size = end - component;
+		if(!((1 == size) && ('.' == component[0])))
+		{
+			memcpy(out, component, size);
+			out[size] = '/';
+			out = out + size + 1;
+		}
+		component = end + 1;
+	}
+	strcpy(out, component);
+	return r;
+}
+
+void write_entry(struct gfk* g, struct entry* e)
+{
+	struct external* x = g->external;
+	int size = strlen(e->path);
+	fwrite(&e->size, sizeof(long), 1, x->spill);
+	fwrite(&size, sizeof(int), 1, x->spill);
+	fwrite(e->path, sizeof(char), size, x->spill);
+}
+
+struct runs* new_run(struct gfk* g)
+{
+	struct external* x = g->external;
+	struct runs* r = calloc(1, sizeof(struct runs));
+	ensure(g, NULL != r, "calloc failed in new_run\n");
+	if(NULL == x->spill)
+	{
+		x->spill = tmpfile();
+		ensure(g, NULL != x->spill, "unable to create a temporary spill file\n");
+	}
+	r->offset = ftell(x->spill);
+	return r;
+}
+
+void finish_run(struct gfk* g, struct runs* r)
+{
+	struct external* x = g->external;
+	ensure(g, 0 == fflush(x->spill), "unable to write spill file\n");
+	r->end = ftell(x->spill);
+}
+
+/* Copy the next size bytes of the run, refilling its buffer with pread as needed */
+void run_read(struct gfk* g, struct runs* r, char* s, int size)
+{
+	struct external* x = g->external;
+	int take;
+	int got;
+	while(0 < size)
+	{
+		if(r->used == r->filled)
+		{
+			take = RUN_BUFFER;
+			if((r->end - r->offset) < take) take = r->end - r->offset;
+			ensure(g, 0 < take, "truncated spill file\n");
+			got = pread(fileno(x->spill), r->buffer, take, r->offset);
+			ensure(g, 0 < got, "unable to read spill file\n");
+			r->offset = r->offset + got;
+			r->filled = got;
+			r->used = 0;
+		}
+		take = r->filled - r->used;
+		if(take > size) take = size;
+		memcpy(s, r->buffer + r->used, take);
+		r->used = r->used + take;
+		s = s + take;
+		size = size - take;
+	}
+}
+
+/* Reuses e->path (which is big enough for any path) */
+int read_entry(struct gfk* g, struct runs* r, struct entry* e)
+{
+	int size;
+	if((r->used == r->filled) && (r->offset == r->end)) return FALSE;
+	run_read(g, r, (char*)&e->size, sizeof(long));
+	run_read(g, r, (char*)&size, sizeof(int));
+	ensure(g, PATH_MAX > size, "corrupt spill file\n");
+	run_read(g, r, e->path, size);
+	e->path[size] = 0;
+	return TRUE;
+}
+
+void spill_pending(struct gfk* g)
+{
+	struct external* x = g->external;
+	long i = 0;
+	if(0 == x->pending_count) return;
+
+	long start = stats_start(g);
+	qsort(x->pending, x->pending_count, sizeof(struct entry), entry_compare);
+	stats_stop(g, STAT_PHASE_TREE, start);
+
+	start = stats_start(g);
+	struct runs* r = new_run(g);
+	while(i < x->pending_count)
+	{
+		write_entry(g, x->pending + i);
+		free(x->pending[i].path);
+		i = i + 1;
+	}
+	finish_run(g, r);
+	stats_stop(g, STAT_PHASE_WRITE, start);
+
+	r->next = x->spilled;
+	x->spilled = r;
+	x->run_count = x->run_count + 1;
+	x->pending_count = 0;
+	x->pending_bytes = 0;
+}
+
+struct external* external_state(struct gfk* g)
+{
+	if(NULL == g->external)
+	{
+		g->external = calloc(1, sizeof(struct external));
+		ensure(g, NULL != g->external, "calloc failed in external_add\n");
+	}
+	return g->external;
+}
+
+void external_add(struct gfk* g, char* s, long size)
+{
+	struct external* x = external_state(g);
+	if(x->pending_count == x->pending_capacity)
+	{
+		x->pending_capacity = (x->pending_capacity << 1) + 1024;
+		x->pending = realloc(x->pending, x->pending_capacity * sizeof(struct entry));
+		ensure(g, NULL != x->pending, "realloc failed in external_add\n");
+	}
+	x->pending[x->pending_count].path = normalize_path(g, s);
+	x->pending[x->pending_count].size = size;
+	/* Rough malloc overhead included */
+	x->pending_bytes = x->pending_bytes + (sizeof(struct entry) << 1) + strlen(s) + 17;
+	x->pending_count = x->pending_count + 1;
+
+	/* Leave the other half of the budget for the index and the merge */
+	if((x->pending_bytes << 1) > g->max_memory) spill_pending(g);
+}
+
+void free_run(struct runs* r)
+{
+	free(r->buffer);
+	free(r->head.path);
+	free(r);
+}
+
+int run_less(struct external* x, long a, long b)
+{
+	return 0 > tree_compare(x->heap[a]->head.path, x->heap[b]->head.path);
+}
+
+void heap_down(struct external* x, long i)
+{
+	long child;
+	struct runs* hold;
+	while(TRUE)
+	{
+		child = (i << 1) + 1;
+		if(child >= x->heap_count) return;
+		if(((child + 1) < x->heap_count) && run_less(x, child + 1, child)) child = child + 1;
+		if(!run_less(x, child, i)) return;
+		hold = x->heap[i];
+		x->heap[i] = x->heap[child];
+		x->heap[child] = hold;
+		i = child;
+	}
+}
+
+/* Start merging the first count runs of list; returns what is left of list */
+struct runs* merge_start(struct gfk* g, struct runs* list, long count)
+{
+	struct external* x = g->external;
+	long i;
+	struct runs* r;
+
+	x->heap_count = 0;
+	while((NULL != list) && (x->heap_count < count))
+	{
+		r = list;
+		list = list->next;
+		r->buffer = calloc(RUN_BUFFER, sizeof(char));
+		r->head.path = calloc(PATH_MAX + 1, sizeof(char));
+		ensure(g, (NULL != r->buffer) && (NULL != r->head.path), "calloc failed in merge_start\n");
+		if(read_entry(g, r, &r->head))
+		{
+			x->heap[x->heap_count] = r;
+			x->heap_count = x->heap_count + 1;
+		}
+		else free_run(r);
+	}
+
+	i = x->heap_count >> 1;
+	while(0 <= i)
+	{
+		heap_down(x, i);
+		i = i - 1;
+	}
+	return list;
+}
+
+/* Returns the smallest entry left or NULL; valid until the next call */
+struct entry* merge_next(struct gfk* g, struct entry* last)
+{
+	struct external* x = g->external;
+	struct runs* r;
+	if(NULL != last)
+	{
+		/* Refill the run we just handed out */
+		r = x->heap[0];
+		if(!read_entry(g, r, &r->head))
+		{
+			free_run(r);
+			x->heap_count = x->heap_count - 1;
+			x->heap[0] = x->heap[x->heap_count];
+		}
+		heap_down(x, 0);
+	}
+	if(0 == x->heap_count) return NULL;
+	return &x->heap[0]->head;
+}
+
+/* Every run being merged costs a buffer plus a path so merge in passes */
+long merge_fan_in(struct gfk* g)
+{
+	long fan_in = (g->max_memory >> 1) / (PATH_MAX + RUN_BUFFER);
+	if(fan_in > 1024) fan_in = 1024;
+	if(fan_in < 2) fan_in = 2;
+	return fan_in;
+}
+
+/* Whatever never hit the limit still has to join the merge */
+void merge_prepare(struct gfk* g)
+{
+	struct external* x = g->external;
+	long fan_in = merge_fan_in(g);
+	struct runs* r;
+	struct runs* tail;
+	struct entry* e;
+
+	spill_pending(g);
+	free(x->pending);
+	x->pending = NULL;
+	x->pending_capacity = 0;
+
+	x->heap = calloc(fan_in + 1, sizeof(struct runs*));
+	ensure(g, NULL != x->heap, "calloc failed in merge_prepare\n");
+
+	while(x->run_count > fan_in)
+	{
+		r = new_run(g);
+		x->spilled = merge_start(g, x->spilled, fan_in);
+		e = merge_next(g, NULL);
+		while(NULL != e)
+		{
+			write_entry(g, e);
+			e = merge_next(g, e);
+		}
+		finish_run(g, r);
+
+		/* Queue it behind the rest so every entry is merged a similar number of times */
+		if(NULL == x->spilled)
+		{
+			x->spilled = r;
+		}
+		else
+		{
+			tail = x->spilled;
+			while(NULL != tail->next) tail = tail->next;
+			tail->next = r;
+		}
+		x->run_count = x->run_count - fan_in + 1;
+	}
+	x->spilled = merge_start(g, x->spilled, fan_in);
+}
+
+long close_folder(struct gfk* g)
+{
+	struct external* x = g->external;
+	x->stack_depth = x->stack_depth - 1;
+	long directory_blocks = directory_blocks_needed(g, x->stack[x->stack_depth].dnodes);
+	long indirect = indirect_blocks_needed(g, directory_blocks);
+	long total = directory_blocks + indirect;
+	g->stats.directory_blocks = g->stats.directory_blocks + directory_blocks;
+	g->stats.indirect_directory_blocks = g->stats.indirect_directory_blocks + indirect;
+	free(x->stack[x->stack_depth].name);
+
+	/* Anything but root also has its name in a block */
+	if(0 != x->stack_depth)
+	{
+		g->stats.name_blocks = g->stats.name_blocks + 1;
+		total = total + 1;
+	}
+
+	ensure(g, sizeof(long) == pwrite(fileno(x->folder_sizes), &total, sizeof(long), x->stack[x->stack_depth].index * sizeof(long)), "unable to write folder sizes\n");
+	x->folder_blocks = x->folder_blocks + total;
+	return total;
+}
+
+void open_folder(struct gfk* g, char* name, int size)
+{
+	struct external* x = g->external;
+	if(x->stack_depth == x->stack_capacity)
+	{
+		x->stack_capacity = (x->stack_capacity << 1) + 16;
+		x->stack = realloc(x->stack, x->stack_capacity * sizeof(struct open_folder));
+		ensure(g, NULL != x->stack, "realloc failed in open_folder\n");
+	}
+	/* A new sub folder is one more dnode for its parent */
+	if(0 < x->stack_depth) x->stack[x->stack_depth - 1].dnodes = x->stack[x->stack_depth - 1].dnodes + 1;
+	x->stack[x->stack_depth].name = calloc(size + 1, sizeof(char));
+	ensure(g, NULL != x->stack[x->stack_depth].name, "calloc failed in open_folder\n");
+	memcpy(x->stack[x->stack_depth].name, name, size);
+	x->stack[x->stack_depth].index = x->folder_count;
+	x->stack[x->stack_depth].dnodes = 0;
+	x->stack[x->stack_depth].packed = 0;
+	x->stack[x->stack_depth].pending = NULL;
+	x->stack[x->stack_depth].level = NULL;
+	x->stack_depth = x->stack_depth + 1;
+	x->folder_count = x->folder_count + 1;
+}
+
+/* How many of the open folders path is still in; *component is left at the
+ * first part of path that isn't one of them
+ */
+int shared_depth(struct external* x, char** component)
+{
+	int depth = 1;
+	char* end = strchr(*component, '/');
+	while((NULL != end) && (depth < x->stack_depth))
+	{
+		if(((end - *component) != (long)strlen(x->stack[depth].name)) || (0 != memcmp(*component, x->stack[depth].name, end - *component))) break;
+		depth = depth + 1;
+		*component = end + 1;
+		end = strchr(*component, '/');
+	}
+	return depth;
+}
+
+/* Same answer (and the same stats) as blocks_needed_for_folders(filesystem) */
+long external_blocks_needed(struct gfk* g)
+{
+	struct external* x = g->external;
+	long total = 0;
+	struct entry* e = NULL;
+	char* component;
+	char* end;
+	int depth;
+
+	merge_prepare(g);
+	x->tree = new_run(g);
+	x->folder_sizes = tmpfile();
+	ensure(g, NULL != x->folder_sizes, "unable to create a temporary folder size file\n");
+	x->folder_count = 0;
+	x->folder_blocks = 0;
+	x->stack_depth = 0;
+	open_folder(g, "/", 1);
+
+	e = merge_next(g, e);
+	while(NULL != e)
+	{
+		write_entry(g, e);
+
+		/* Keep the folders we share with this path, close the rest */
+		component = e->path;
+		depth = shared_depth(x, &component);
+		while(x->stack_depth > depth) total = total + close_folder(g);
+
+		/* And open whatever is new */
+		end = strchr(component, '/');
+		while(NULL != end)
+		{
+			ensure(g, (end - component) < g->volume_block_size, "file names must be shorter than the volume block size\n");
+			open_folder(g, component, end - component);
+			component = end + 1;
+			end = strchr(component, '/');
+		}
+
+		ensure(g, (long)strlen(component) < g->volume_block_size, "file names must be shorter than the volume block size\n");
+		x->stack[x->stack_depth - 1].dnodes = x->stack[x->stack_depth - 1].dnodes + 1;
+		if(g->pack_tails) total = total + blocks_needed_for_file(g, e->size, &x->stack[x->stack_depth - 1].packed);
+		else total = total + blocks_needed_for_file(g, e->size, NULL);
+		e = merge_next(g, e);
+	}
+
+	while(0 < x->stack_depth) total = total + close_folder(g);
+	finish_run(g, x->tree);
+	ensure(g, 0 == fflush(x->folder_sizes), "unable to write folder sizes\n");
+	free(x->heap);
+	x->heap = NULL;
+	return total;
+}
+
+/* Directory blocks are encoded as their dnodes come in, so a folder only ever
+ * holds a single block's worth of them plus the inodes of the blocks it wrote
+ */
+void flush_directory_block(struct gfk* g, struct open_folder* o)
+{
+	struct external* x = g->external;
+	if(o->blocks == o->level_capacity)
+	{
+		o->level_capacity = (o->level_capacity << 1) + 4;
+		o->level = realloc(o->level, o->level_capacity * sizeof(struct inode));
+		ensure(g, NULL != o->level, "realloc failed in flush_directory_block\n");
+	}
+	x->directory_block->buffer[0] = FOLDER_TAGE;
+	g->encode_dnodes(g, x->directory_block->buffer + 1, o->pending, o->pending_count);
+	emit_block(g, x->directory_block->buffer, o->address + o->blocks, o->level + o->blocks);
+	o->blocks = o->blocks + 1;
+	o->pending_count = 0;
+}
+
+void add_dnode(struct gfk* g, struct open_folder* o, struct inode* name, struct inode* contents, long size)
+{
+	o->pending[o->pending_count].name = *name;
+	o->pending[o->pending_count].contents = *contents;
+	o->pending[o->pending_count].size = size;
+	o->pending_count = o->pending_count + 1;
+	if(max_dnodes(g) == o->pending_count) flush_directory_block(g, o);
+}
+
+/* Files become dnodes in order, but one with its tail in a packed block that
+ * is still open holds up everything after it; so only pass on the ones done.
+ * Only the files being passed on are waited for, the pool carries on with
+ * the rest.
+ */
+void pass_finished_files(struct gfk* g, int all)
+{
+	struct external* x = g->external;
+	long i = 0;
+	long j = 0;
+	struct files* f;
+
+	if(all)
+	{
+		close_packed_block(g);
+	}
+	else if(!held_by_packed_block(g, x->done_files[0]))
+	{
+		/* A block's worth is waiting; keep from getting further ahead */
+		pool_wait_for(g, &x->done_files[0]->written);
+	}
+
+	while(i < x->done_count)
+	{
+		f = x->done_files[i];
+		if(all) pool_wait_for(g, &f->written);
+		if(!__atomic_load_n(&f->written, __ATOMIC_ACQUIRE)) break;
+		add_dnode(g, x->stack + x->stack_depth - 1, &f->name_inode, &f->root, f->size);
+		free(f->name);
+		free(f->path);
+		free(f);
+		i = i + 1;
+	}
+	while(i < x->done_count)
+	{
+		x->done_files[j] = x->done_files[i];
+		i = i + 1;
+		j = j + 1;
+	}
+	x->done_count = j;
+}
+
+void write_open_folder(struct gfk* g, char* name, int size)
+{
+	struct external* x = g->external;
+	long total;
+	struct open_folder* o;
+	open_folder(g, name, size);
+	o = x->stack + x->stack_depth - 1;
+	ensure(g, sizeof(long) == pread(fileno(x->folder_sizes), &total, sizeof(long), o->index * sizeof(long)), "unable to read folder sizes\n");
+
+	/* Same layout place_folders() gives it: the name then the directory blocks */
+	o->address = x->folder_blocks;
+	x->folder_blocks = x->folder_blocks + total;
+	if(1 != x->stack_depth) o->address = o->address + 1;
+	o->blocks = 0;
+	o->pending = calloc(max_dnodes(g), sizeof(struct dnode));
+	ensure(g, NULL != o->pending, "calloc failed in write_open_folder\n");
+	o->pending_count = 0;
+	o->level = NULL;
+	o->level_capacity = 0;
+}
+
+void write_close_folder(struct gfk* g, struct inode* root)
+{
+	struct external* x = g->external;
+	struct open_folder* o = x->stack + x->stack_depth - 1;
+	struct inode name;
+	struct inode contents;
+
+	/* Even an empty folder gets a directory block */
+	if((0 != o->pending_count) || (0 == o->blocks)) flush_directory_block(g, o);
+	write_indirect_levels(g, o->level, o->blocks, o->address + o->blocks, FOLDER_INDIRECT_TAG, x->directory_block->buffer, &contents);
+	o->level = NULL;
+	free(o->pending);
+	o->pending = NULL;
+
+	if(1 == x->stack_depth)
+	{
+		*root = contents;
+	}
+	else
+	{
+		write_name_block(g, o->name, o->address - 1, x->directory_block->buffer, &name);
+		add_dnode(g, o - 1, &name, &contents, 0);
+	}
+	free(o->name);
+	x->stack_depth = x->stack_depth - 1;
+}
+
+/* write_filesystem() for the merged stream; every block lands where the in
+ * memory tree would have put it so the image comes out byte for byte the same
+ */
+void write_external(struct gfk* g, struct inode* root)
+{
+	struct external* x = g->external;
+	struct files* f;
+	char* component;
+	char* end;
+	int depth;
+
+	x->directory_block = create_buffer(g, g->allocated, g->volume_block_size);
+	x->tree->buffer = calloc(RUN_BUFFER, sizeof(char));
+	x->tree->head.path = calloc(PATH_MAX + 1, sizeof(char));
+	ensure(g, (NULL != x->tree->buffer) && (NULL != x->tree->head.path), "calloc failed in write_external\n");
+	x->tree->used = 0;
+	x->tree->filled = 0;
+
+	/* Folders get their blocks up front, in the order they get opened */
+	x->folder_blocks = get_free_blocks(g, x->folder_blocks);
+	x->folder_count = 0;
+	x->stack_depth = 0;
+	write_open_folder(g, "/", 1);
+
+	while(read_entry(g, x->tree, &x->tree->head))
+	{
+		component = x->tree->head.path;
+		depth = shared_depth(x, &component);
+		end = strchr(component, '/');
+
+		/* Done with the files of the folder we were in */
+		if((x->stack_depth > depth) || (NULL != end)) pass_finished_files(g, TRUE);
+		while(x->stack_depth > depth) write_close_folder(g, root);
+		while(NULL != end)
+		{
+			write_open_folder(g, component, end - component);
+			component = end + 1;
+			end = strchr(component, '/');
+		}
+
+		f = calloc(1, sizeof(struct files));
+		ensure(g, NULL != f, "calloc failed in write_external\n");
+		f->name = strdup(component);
+		f->path = strdup(x->tree->head.path);
+		ensure(g, (NULL != f->name) && (NULL != f->path), "strdup failed in write_external\n");
+		f->size = x->tree->head.size;
+		f->fd = -1;
+		write_file_data(g, f, stream_next);
+
+		if(x->done_count == x->done_capacity)
+		{
+			x->done_capacity = (x->done_capacity << 1) + 64;
+			x->done_files = realloc(x->done_files, x->done_capacity * sizeof(struct files*));
+			ensure(g, NULL != x->done_files, "realloc failed in write_external\n");
+		}
+		x->done_files[x->done_count] = f;
+		x->done_count = x->done_count + 1;
+		if(max_dnodes(g) <= x->done_count) pass_finished_files(g, FALSE);
+	}
+
+	pass_finished_files(g, TRUE);
+	while(0 < x->stack_depth) write_close_folder(g, root);
+
+	free(x->tree->buffer);
+	free(x->tree->head.path);
+	free(x->tree);
+	x->tree = NULL;
+	free(x->done_files);
+	x->done_files = NULL;
+	x->done_capacity = 0;
+	fclose(x->folder_sizes);
+	x->folder_sizes = NULL;
+	remove_buffer(g, x->directory_block);
+}
+
+/* Whatever a failed (or finished) build left behind; the directory block goes
+ * back with the rest of g->allocated
+ */
+void external_free(struct gfk* g)
+{
+	struct external* x = g->external;
+	struct runs* r;
+	struct files* f;
+	long i;
+	if(NULL == x) return;
+
+	if(NULL != x->spill) fclose(x->spill);
+	if(NULL != x->folder_sizes) fclose(x->folder_sizes);
+
+	i = 0;
+	while(i < x->pending_count)
+	{
+		free(x->pending[i].path);
+		i = i + 1;
+	}
+	free(x->pending);
+
+	while(NULL != x->spilled)
+	{
+		r = x->spilled;
+		x->spilled = r->next;
+		free_run(r);
+	}
+	i = 0;
+	while(i < x->heap_count)
+	{
+		free_run(x->heap[i]);
+		i = i + 1;
+	}
+	free(x->heap);
+	if(NULL != x->tree) free_run(x->tree);
+
+	i = 0;
+	while(i < x->stack_depth)
+	{
+		free(x->stack[i].name);
+		free(x->stack[i].pending);
+		free(x->stack[i].level);
+		i = i + 1;
+	}
+	free(x->stack);
+
+	i = 0;
+	while(i < x->done_count)
+	{
+		f = x->done_files[i];
+		free(f->name);
+		free(f->path);
+		free(f);
+		i = i + 1;
+	}
+	free(x->done_files);
+
+	free(x);
+	g->external = NULL;
+}
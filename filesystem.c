@@ -16,11 +16,7 @@
  */
 
 #include "gfk_create.h"
-
-int BigByteEndian;
-int BigBitEndian;
-char* MBR;
-struct folders* filesystem;
+#include <pthread.h>
 
 struct files* insert_file(struct files* a, struct files* b)
 {
@@ -53,7 +49,6 @@ struct folders* insert_folder(struct folders* a, struct folders* b)
 struct folders* find_folder(struct folders* walk, char* name)
 {
 	if(NULL == walk) return NULL;
-	require(NULL != name, "A non-name is not a valid name for a directory\n");
 	if(match(walk->name, name))
 	{
 		return walk;
@@ -61,7 +56,7 @@ struct folders* find_folder(struct folders* walk, char* name)
 	return find_folder(walk->next, name);
 }
 
-void put_in_folders(struct folders* walk, struct files* f, char* PATH)
+void put_in_folders(struct gfk* g, struct folders* walk, struct files* f, char* PATH)
 {
 	if(NULL == walk) return;
 	if(NULL == f) return;
@@ -101,36 +96,26 @@ void put_in_folders(struct folders* walk, struct files* f, char* PATH)
 	{
 		/* lets create the folder this belongs in */
 		d = calloc(1, sizeof( struct folders));
+		ensure(g, NULL != d, "calloc failed in put_in_folders\n");
 		d->name = PATH;
 		walk->sub = insert_folder(walk->sub, d);
 	}
-	put_in_folders(d, f, hold);
+	put_in_folders(g, d, f, hold);
 }
 
-void process_file(char* s)
+void missing_file(struct gfk* g, char* s)
 {
-	require(NULL != s, "got a NULL filename somehow\n");
-	int i = strlen(s);
-	require(0 != i, "got an empty filename somehow\n");
-
-	/* Now lets get it */
-	struct files* f = calloc(1, sizeof(struct files));
-	require(NULL != f, "calloc failed in process_file\n");
-
-	/* Lets see if we can open it */
-	f->f = fopen(s, "r");
-	if(0 == f->f)
-	{
-		fputs("The file named: ", stdout);
-		fputs(s, stdout);
-		fputs(" either does not exit or you don't have read permissions to it\n", stdout);
-		exit(EXIT_FAILURE);
-	}
+	char message[PATH_MAX + 96];
+	strcpy(message, "The file named: ");
+	strncat(message, s, PATH_MAX - 1);
+	strcat(message, " either does not exit or you don't have read permissions to it\n");
+	fail(g, message);
+}
 
-	/* How big is it? */
-	fseek(f->f, 0, SEEK_END);
-	f->size = ftell(f->f);
-	rewind(f->f);
+/* Put f in the tree at the path s (which gets cut up) */
+void place_file(struct gfk* g, struct files* f, char* s)
+{
+	int i = strlen(s);
 
 	/* Assume everything is at root */
 	f->name = s;
@@ -148,17 +133,739 @@ void process_file(char* s)
 		i = i - 1;
 	}
 
-	put_in_folders(filesystem, f, PATH);
+	long start = stats_start(g);
+	put_in_folders(g, g->filesystem, f, PATH);
+	stats_stop(g, STAT_PHASE_TREE, start);
 }
 
-void write_file(struct files* f)
+/* s ends up in the tree so it has to stay put (see remember()) */
+void process_file(struct gfk* g, char* s)
 {
+	ensure(g, NULL != s, "got a NULL filename somehow\n");
+	int i = strlen(s);
+	ensure(g, 0 != i, "got an empty filename somehow\n");
+
+	/* Lets see if we can open it; the prefetcher opens it again when it is needed
+	 * so we don't run out of file descriptors on big trees
+	 */
+	long start = stats_start(g);
+	int fd = open(s, O_RDONLY);
+	if(0 > fd) missing_file(g, s);
+
+	/* How big is it? (ftell is only 32bits on some targets) */
+	struct stat sb;
+	i = fstat(fd, &sb);
+	close(fd);
+	ensure(g, 0 == i, "unable to stat input file\n");
+	stats_stop(g, STAT_PHASE_STAT, start);
+	g->stats.files_ingested = g->stats.files_ingested + 1;
+	g->stats.bytes_ingested = g->stats.bytes_ingested + sb.st_size;
+
+	if(0 != g->max_memory)
+	{
+		/* Just remember the name and size; the tree gets built by the merge */
+		external_add(g, s, sb.st_size);
+		stats_progress(g);
+		return;
+	}
+
+	/* Now lets get it */
+	char* path = strdup(s);
+	ensure(g, NULL != path, "strdup failed in process_file\n");
+	struct files* f = calloc(1, sizeof(struct files));
+	if(NULL == f) free(path);
+	ensure(g, NULL != f, "calloc failed in process_file\n");
+	f->path = path;
+	f->size = sb.st_size;
+	f->fd = -1;
+
+	place_file(g, f, s);
+	stats_progress(g);
 }
 
-void write_folder(struct folders* f)
+/* One path per line, for trees too big to put on the command line */
+void process_file_list(struct gfk* g, char* name)
 {
+	FILE* list = fopen(name, "r");
+	ensure(g, NULL != list, "unable to open --file-list for reading\n");
+	char* line = NULL;
+	size_t capacity = 0;
+	int size = getline(&line, &capacity, list);
+	while(0 <= size)
+	{
+		if((0 < size) && ('\n' == line[size - 1]))
+		{
+			size = size - 1;
+			line[size] = 0;
+		}
+		if((0 < size) && (0 != gfk_add_path(g, line)))
+		{
+			/* gfk_add_path already kept the reason */
+			free(line);
+			fclose(list);
+			fail(g, gfk_error(g));
+		}
+		size = getline(&line, &capacity, list);
+	}
+	free(line);
+	fclose(list);
 }
 
-void write_filesystem()
+/* Writing happens in two halves: this thread reads the file data in the
+ * planned order and hands it out in batches while the pool checksums and
+ * writes them, turns finished file blocks into the blocks above them and
+ * folders into directory blocks. A folder is ready once the inodes of all of
+ * its children are known so the work flows bottom up as a DAG; since every
+ * block's address is fixed before any of it starts the image comes out the same
+ * however the jobs happen to be scheduled.
+ */
+
+/* A file block or indirect file block still waiting on the inodes of some of
+ * the blocks under it; whoever hands in the last of them writes it out
+ */
+struct level_block
+{
+	struct inode* inodes;
+	long count;
+	long pending;
+	long address;
+	int tag;
+	struct level_block* parent;
+	long slot;
+	struct files* f;
+	/* Every one still waiting, so a failed build can let go of them */
+	struct level_block* prev;
+	struct level_block* next;
+};
+
+/* A tail's two inodes, filled in once its packed block is written */
+struct tails
+{
+	struct level_block* block[2];
+	long slot[2];
+	long offset;
+};
+
+/* A run of one file's data blocks under the same file block, or a packed
+ * block and the tails in it; a pool job checksums and writes it
+ */
+struct batch
+{
+	struct buffers* block;
+	long address;
+	long count;
+	struct level_block* parent;
+	long slot;
+	struct tails* tails;
+	long tail_count;
+	long tail_capacity;
+	int free;
+};
+
+/* The packed block the tails of the current folder are going into */
+struct packing
+{
+	struct batch* batch;
+	long used;
+	struct files* first;
+};
+
+#define BATCH_BYTES 131072
+#define MAX_LEVELS 64
+
+/* The file being written; only the block each of its levels is filling is
+ * kept, so a file needs the same memory however big it is
+ */
+struct streaming
 {
+	struct batch* batches;
+	int batch_count;
+	int next_batch;
+	long batch_blocks;
+	struct buffers* scratch;
+	int levels;
+	long children[MAX_LEVELS];
+	long blocks[MAX_LEVELS];
+	long base[MAX_LEVELS];
+	long opened[MAX_LEVELS];
+	struct level_block* open[MAX_LEVELS];
+	long assigned;
+	pthread_mutex_t lock;
+	struct level_block* live;
+};
+
+void finish_child(struct gfk* g, struct folders* parent);
+
+void write_folder(struct gfk* g, void* item)
+{
+	struct folders* a = item;
+	long count = files_count(a->f) + folders_count(a->sub);
+	struct dnode* dnodes = calloc(count + 1, sizeof(struct dnode));
+	ensure(g, NULL != dnodes, "calloc failed in write_folder\n");
+	struct buffers* b = create_buffer(g, pool_buffers(g), g->volume_block_size);
+	long address = a->address;
+	long i = 0;
+
+	struct files* f = a->f;
+	while(NULL != f)
+	{
+		dnodes[i].name = f->name_inode;
+		dnodes[i].contents = f->root;
+		dnodes[i].size = f->size;
+		i = i + 1;
+		f = f->next;
+	}
+	struct folders* d = a->sub;
+	while(NULL != d)
+	{
+		dnodes[i].name = d->name_inode;
+		dnodes[i].contents = d->root;
+		i = i + 1;
+		d = d->next;
+	}
+
+	if(NULL != a->parent)
+	{
+		write_name_block(g, a->name, address, b->buffer, &a->name_inode);
+		address = address + 1;
+	}
+	write_directory_blocks(g, dnodes, count, address, b->buffer, &a->root);
+
+	remove_buffer(g, b);
+	free(dnodes);
+	finish_child(g, a->parent);
+}
+
+/* The last child to finish makes its folder ready */
+void finish_child(struct gfk* g, struct folders* parent)
+{
+	if(NULL == parent) return;
+	if(0 == __atomic_sub_fetch(&parent->pending, 1, __ATOMIC_ACQ_REL)) pool_submit(g, write_folder, parent);
+}
+
+/* Its file blocks are all written so only the name block is left */
+void file_written(struct gfk* g, struct files* f)
+{
+	struct folders* parent = f->parent;
+	struct buffers* b = create_buffer(g, pool_buffers(g), g->volume_block_size);
+	write_name_block(g, f->name, f->address, b->buffer, &f->name_inode);
+	remove_buffer(g, b);
+	/* write_external() may free f as soon as it sees this */
+	__atomic_store_n(&f->written, TRUE, __ATOMIC_RELEASE);
+	finish_child(g, parent);
+}
+
+void forget_level_block(struct gfk* g, struct level_block* b)
+{
+	struct streaming* s = g->streaming;
+	pthread_mutex_lock(&s->lock);
+	if(NULL != b->prev) b->prev->next = b->next;
+	else s->live = b->next;
+	if(NULL != b->next) b->next->prev = b->prev;
+	pthread_mutex_unlock(&s->lock);
+	free(b->inodes);
+	free(b);
+}
+
+/* slots more of b's inodes are in; the last ones write b and hand its inode
+ * up, once nothing is above it that is the file's root
+ */
+void level_written(struct gfk* g, struct level_block* b, long slots)
+{
+	struct level_block* parent;
+	struct buffers* block;
+	struct inode out;
+	struct files* f;
+	long slot;
+
+	while(0 == __atomic_sub_fetch(&b->pending, slots, __ATOMIC_ACQ_REL))
+	{
+		block = create_buffer(g, pool_buffers(g), g->volume_block_size);
+		block->buffer[0] = b->tag;
+		g->encode_inodes(g, block->buffer + 1, b->inodes, b->count);
+		emit_block(g, block->buffer, b->address, &out);
+		remove_buffer(g, block);
+
+		parent = b->parent;
+		slot = b->slot;
+		f = b->f;
+		forget_level_block(g, b);
+		if(NULL == parent)
+		{
+			f->root = out;
+			file_written(g, f);
+			return;
+		}
+		parent->inodes[slot] = out;
+		b = parent;
+		slots = 1;
+	}
+}
+
+/* Start the next block of level (0 being the file blocks) at the address
+ * file_blocks_needed() and indirect_blocks_needed() planned for it, and the
+ * block above it too if this is the first one that points at
+ */
+void open_level_block(struct gfk* g, struct files* f, int level)
+{
+	struct streaming* s = g->streaming;
+	int per = max_inodes(g);
+	long index = s->opened[level];
+	struct level_block* b = calloc(1, sizeof(struct level_block));
+	ensure(g, NULL != b, "calloc failed in open_level_block\n");
+	b->count = s->children[level] - (index * per);
+	if(b->count > per) b->count = per;
+	b->inodes = calloc(b->count + 1, sizeof(struct inode));
+	if(NULL == b->inodes) free(b);
+	ensure(g, NULL != b->inodes, "calloc failed in open_level_block\n");
+	b->pending = b->count;
+	b->address = s->base[level] + index;
+	b->tag = FILE_TAG;
+	if(0 != level) b->tag = FILE_INDIRECT_TAG;
+	b->f = f;
+
+	pthread_mutex_lock(&s->lock);
+	b->next = s->live;
+	if(NULL != s->live) s->live->prev = b;
+	s->live = b;
+	pthread_mutex_unlock(&s->lock);
+
+	if((level + 1) < s->levels)
+	{
+		if(0 == (index % per)) open_level_block(g, f, level + 1);
+		b->parent = s->open[level + 1];
+		b->slot = index % per;
+	}
+	s->open[level] = b;
+	s->opened[level] = index + 1;
+}
+
+/* The file block the next inode of the file goes in, and where in it */
+struct level_block* next_slot(struct gfk* g, struct files* f, long* slot)
+{
+	struct streaming* s = g->streaming;
+	int per = max_inodes(g);
+	if(0 == (s->assigned % per)) open_level_block(g, f, 0);
+	*slot = s->assigned % per;
+	s->assigned = s->assigned + 1;
+	return s->open[0];
+}
+
+/* Checksum and write a batch; the inodes go to the blocks pointing at it */
+void write_batch(struct gfk* g, void* item)
+{
+	struct batch* b = item;
+	struct inode* inode;
+	struct tails* t;
+	struct inode tail;
+	long i = 0;
+
+	if(0 != b->tail_count)
+	{
+		emit_block(g, b->block->buffer, b->address, &tail);
+		while(i < b->tail_count)
+		{
+			t = b->tails + i;
+			t->block[0]->inodes[t->slot[0]] = tail;
+			t->block[1]->inodes[t->slot[1]].address = t->offset;
+			level_written(g, t->block[0], 1);
+			level_written(g, t->block[1], 1);
+			i = i + 1;
+		}
+	}
+	else
+	{
+		/* Consecutive blocks, so one write covers them all */
+		while(i < b->count)
+		{
+			inode = b->parent->inodes + b->slot + i;
+			inode->address = b->address + i;
+			inode->checksum = checksum_block(g, b->block->buffer + (i * g->volume_block_size));
+			i = i + 1;
+		}
+		write_at(g, b->block->buffer, b->count * g->volume_block_size, b->address * g->volume_block_size);
+		level_written(g, b->parent, b->count);
+	}
+	__atomic_store_n(&b->free, TRUE, __ATOMIC_RELEASE);
+}
+
+/* An empty file still gets its file block, with nothing in it to wait on */
+void write_empty_file(struct gfk* g, void* item)
+{
+	level_written(g, item, 0);
+}
+
+/* Batches are handed out in turn, skipping the one the packed block holds, so
+ * the one we get is the one that went to the pool longest ago
+ */
+struct batch* take_batch(struct gfk* g)
+{
+	struct streaming* s = g->streaming;
+	struct batch* b = s->batches + s->next_batch;
+	if(b == g->packing->batch)
+	{
+		s->next_batch = (s->next_batch + 1) % s->batch_count;
+		b = s->batches + s->next_batch;
+	}
+	s->next_batch = (s->next_batch + 1) % s->batch_count;
+	pool_wait_for(g, &b->free);
+	b->free = FALSE;
+	b->count = 0;
+	b->tail_count = 0;
+	return b;
+}
+
+/* Files with a tail in the packed block need its checksum before they are ready */
+void close_packed_block(struct gfk* g)
+{
+	struct packing* p = g->packing;
+	if(0 == p->used) return;
+
+	memset(p->batch->block->buffer + p->used, 0, g->volume_block_size - p->used);
+	pool_submit(g, write_batch, p->batch);
+	p->batch = NULL;
+	p->used = 0;
+}
+
+/* Whether f can only finish once the open packed block is closed; files are
+ * only asked about oldest first, so the first tail in it is enough to know
+ */
+int held_by_packed_block(struct gfk* g, struct files* f)
+{
+	struct packing* p = g->packing;
+	return (0 != p->used) && (f == p->first);
+}
+
+/* Next fit, exactly like pack_tail() planned it */
+void pack_file_tail(struct gfk* g, struct files* f, char* tail, int size)
+{
+	struct packing* p = g->packing;
+	struct tails* grown;
+	struct tails* t;
+	struct batch* b;
+	if((0 == p->used) || ((p->used + size) > g->volume_block_size))
+	{
+		close_packed_block(g);
+		p->batch = take_batch(g);
+		p->batch->address = get_free_block(g);
+		p->first = f;
+	}
+	b = p->batch;
+	if(b->tail_count == b->tail_capacity)
+	{
+		grown = realloc(b->tails, ((b->tail_capacity << 1) + 16) * sizeof(struct tails));
+		ensure(g, NULL != grown, "realloc failed in pack_file_tail\n");
+		b->tails = grown;
+		b->tail_capacity = (b->tail_capacity << 1) + 16;
+	}
+	t = b->tails + b->tail_count;
+	b->tail_count = b->tail_count + 1;
+
+	memcpy(b->block->buffer + p->used, tail, size);
+	t->offset = p->used;
+	t->block[0] = next_slot(g, f, t->slot);
+	t->block[1] = next_slot(g, f, t->slot + 1);
+	p->used = p->used + size;
+}
+
+/* Where everything of f but its data goes: the name block, then the file
+ * blocks, then each level of indirect blocks above them
+ */
+void plan_file_blocks(struct gfk* g, struct files* f, long pointers)
+{
+	struct streaming* s = g->streaming;
+	int level = 0;
+	s->children[0] = pointers;
+	s->blocks[0] = file_blocks_needed(g, pointers);
+	s->base[0] = f->address + 1;
+	s->opened[0] = 0;
+	while(1 < s->blocks[level])
+	{
+		ensure(g, (level + 1) < MAX_LEVELS, "too many levels of indirect blocks\n");
+		s->children[level + 1] = s->blocks[level];
+		s->blocks[level + 1] = divide_round_up(s->blocks[level], max_inodes(g));
+		s->base[level + 1] = s->base[level] + s->blocks[level];
+		s->opened[level + 1] = 0;
+		level = level + 1;
+	}
+	s->levels = level + 1;
+	s->assigned = 0;
+}
+
+/* next hands out the chunks of f in order, zero once it is done. The data goes
+ * out in batches as it is read and the blocks above it follow as soon as what
+ * they point at is written, so none of them wait for the whole file.
+ */
+void write_file_data(struct gfk* g, struct files* f, int (*next)(struct gfk*, struct files*, char*))
+{
+	struct streaming* s = g->streaming;
+	struct packing* p = g->packing;
+	struct batch* b = NULL;
+	struct level_block* parent;
+	long address;
+	long slot;
+	long tail = 0;
+	long data_blocks;
+	long pointers;
+	long total = 1;
+	char* chunk;
+	int size = 1;
+	int i = 0;
+
+	/* No point carrying on once a job has failed; this hands it to us */
+	if(__atomic_load_n(&g->failed, __ATOMIC_ACQUIRE)) pool_wait(g);
+
+	if(g->pack_tails) tail = f->size % g->volume_block_size;
+	data_blocks = blocks_needed_for_file_data(g, f->size);
+	pointers = data_blocks;
+	if(0 != tail)
+	{
+		data_blocks = data_blocks - 1;
+		pointers = pointers + 1;
+	}
+
+	/* The data blocks come first, then the packed block if the tail starts a
+	 * new one; the file's own blocks are right after, so they are known now
+	 */
+	f->address = get_free_blocks(g, 0) + data_blocks;
+	if((0 != tail) && ((0 == p->used) || ((p->used + tail) > g->volume_block_size))) f->address = f->address + 1;
+	plan_file_blocks(g, f, pointers);
+
+	if(0 == pointers)
+	{
+		open_level_block(g, f, 0);
+		pool_submit(g, write_empty_file, s->open[0]);
+	}
+
+	while(0 < size)
+	{
+		if((NULL == b) && (s->assigned < data_blocks)) b = take_batch(g);
+		chunk = s->scratch->buffer;
+		if(NULL != b) chunk = b->block->buffer + (b->count * g->volume_block_size);
+
+		size = next(g, f, chunk);
+		if(0 == size)
+		{
+			/* Done */
+		}
+		else if((0 != tail) && (size < g->volume_block_size))
+		{
+			pack_file_tail(g, f, chunk, size);
+		}
+		else
+		{
+			/* Don't leak a previous batch into the end of the last block */
+			memset(chunk + size, 0, g->volume_block_size - size);
+			address = get_free_block(g);
+			parent = next_slot(g, f, &slot);
+			if(0 == b->count)
+			{
+				b->address = address;
+				b->parent = parent;
+				b->slot = slot;
+			}
+			b->count = b->count + 1;
+
+			/* A batch never spans two file blocks */
+			if((b->count == s->batch_blocks) || (0 == (s->assigned % max_inodes(g))) || (s->assigned == data_blocks))
+			{
+				pool_submit(g, write_batch, b);
+				b = NULL;
+			}
+		}
+	}
+
+	while(i < s->levels)
+	{
+		total = total + s->blocks[i];
+		i = i + 1;
+	}
+	ensure(g, f->address == get_free_blocks(g, total), "file blocks didn't land where they were planned\n");
+}
+/* Same order as prefetch_collect(): a folder's files, its sub folders, then the next */
+void write_folder_data(struct gfk* g, struct folders* a)
+{
+	struct files* f;
+	while(NULL != a)
+	{
+		f = a->f;
+		while(NULL != f)
+		{
+			write_file_data(g, f, prefetch_next);
+			f = f->next;
+		}
+		close_packed_block(g);
+		write_folder_data(g, a->sub);
+		a = a->next;
+	}
+}
+
+/* Folders get their blocks up front, right after the leadblock */
+void place_folders(struct gfk* g, struct folders* a, struct folders* parent)
+{
+	struct files* f;
+	while(NULL != a)
+	{
+		a->parent = parent;
+		a->address = get_free_blocks(g, a->blocks_needed + (NULL != parent));
+		a->pending = files_count(a->f) + folders_count(a->sub);
+		f = a->f;
+		while(NULL != f)
+		{
+			f->parent = a;
+			f = f->next;
+		}
+		place_folders(g, a->sub, a);
+		a = a->next;
+	}
+}
+
+/* Folders with nothing in them are ready straight away */
+void submit_empty_folders(struct gfk* g, struct folders* a)
+{
+	while(NULL != a)
+	{
+		if(0 == a->pending) pool_submit(g, write_folder, a);
+		else submit_empty_folders(g, a->sub);
+		a = a->next;
+	}
+}
+
+/* Names that can't fit in a name block are turned away before anything is
+ * written; a is root to start with, which never gets one
+ */
+void check_names(struct gfk* g, struct folders* a)
+{
+	struct files* f = a->f;
+	struct folders* d = a->sub;
+	while(NULL != f)
+	{
+		ensure(g, (long)strlen(f->name) < g->volume_block_size, "file names must be shorter than the volume block size\n");
+		f = f->next;
+	}
+	while(NULL != d)
+	{
+		ensure(g, (long)strlen(d->name) < g->volume_block_size, "file names must be shorter than the volume block size\n");
+		check_names(g, d);
+		d = d->next;
+	}
+}
+
+/* Whatever a failed (or finished) build left the writer holding; the buffers
+ * themselves go back with the rest of g->allocated
+ */
+void free_writer(struct gfk* g)
+{
+	struct streaming* s = g->streaming;
+	struct level_block* b;
+	int i = 0;
+	free(g->packing);
+	g->packing = NULL;
+	if(NULL == s) return;
+
+	while(NULL != s->live)
+	{
+		b = s->live;
+		s->live = b->next;
+		free(b->inodes);
+		free(b);
+	}
+	while(i < s->batch_count)
+	{
+		free(s->batches[i].tails);
+		i = i + 1;
+	}
+	free(s->batches);
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+	g->streaming = NULL;
+}
+
+/* Enough batches for every worker to have one going and one more queued */
+void start_writer(struct gfk* g)
+{
+	struct streaming* s;
+	long budget;
+	int i = 0;
+
+	g->packing = calloc(1, sizeof(struct packing));
+	ensure(g, NULL != g->packing, "calloc failed in start_writer\n");
+	s = calloc(1, sizeof(struct streaming));
+	ensure(g, NULL != s, "calloc failed in start_writer\n");
+	pthread_mutex_init(&s->lock, NULL);
+	g->streaming = s;
+
+	s->batch_count = 2 * g->pool_threads;
+	if(2 > s->batch_count) s->batch_count = 2;
+	s->batch_blocks = BATCH_BYTES / g->volume_block_size;
+	if(0 != g->max_memory)
+	{
+		/* The merge already gets half of --max-memory, keep to a quarter of
+		 * it; fewer batches cost less than smaller ones
+		 */
+		budget = (g->max_memory >> 2) / (s->batch_blocks * g->volume_block_size);
+		if(budget < s->batch_count) s->batch_count = budget;
+		if(2 > s->batch_count) s->batch_count = 2;
+		budget = (g->max_memory >> 2) / (s->batch_count * g->volume_block_size);
+		if(budget < s->batch_blocks) s->batch_blocks = budget;
+	}
+	if(1 > s->batch_blocks) s->batch_blocks = 1;
+
+	s->batches = calloc(s->batch_count, sizeof(struct batch));
+	ensure(g, NULL != s->batches, "calloc failed in start_writer\n");
+	while(i < s->batch_count)
+	{
+		s->batches[i].block = create_buffer(g, g->allocated, s->batch_blocks * g->volume_block_size);
+		s->batches[i].free = TRUE;
+		i = i + 1;
+	}
+	s->scratch = create_buffer(g, g->allocated, g->volume_block_size);
+}
+
+/* Only once the pool is done with them */
+void stop_writer(struct gfk* g)
+{
+	struct streaming* s = g->streaming;
+	int i = 0;
+	while(i < s->batch_count)
+	{
+		remove_buffer(g, s->batches[i].block);
+		i = i + 1;
+	}
+	remove_buffer(g, s->scratch);
+	free_writer(g);
+}
+
+void write_filesystem(struct gfk* g, long volume_blocks_needed)
+{
+	long first = get_free_blocks(g, 0);
+
+	/* O_DIRECT offsets have to land on sector boundaries */
+	if(g->direct_mode && (0 != (g->volume_block_size % g->buffer_alignment)))
+	{
+		leave_direct_mode(g, "volume blocks are smaller than the device sector");
+	}
+
+	start_writer(g);
+	pool_start(g);
+	if(0 != g->max_memory)
+	{
+		write_external(g, &g->filesystem->root);
+	}
+	else
+	{
+		place_folders(g, g->filesystem, NULL);
+		submit_empty_folders(g, g->filesystem);
+
+		prefetch_start(g, g->filesystem);
+		write_folder_data(g, g->filesystem);
+		prefetch_stop(g);
+	}
+
+	pool_wait(g);
+	pool_stop(g);
+	ensure(g, volume_blocks_needed == (get_free_blocks(g, 0) - first), "the image didn't come out the size it was planned\n");
+	write_superblock(g, &g->filesystem->root);
+
+	stop_writer(g);
 }
@@ -0,0 +1,448 @@
+/* Copyright (C) 2022 Jeremiah Orians
+ * This file is part of GFK
+ *
+ * GFK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GFK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GFK If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gfk_create.h"
+
+/* Every file size is kept as a count of 512byte sectors (the smallest legal block)
+ * which rounds up to any legal block size exactly; ceil(ceil(x/a)/b) == ceil(x/ab)
+ */
+#define SMALLEST_BLOCK 512
+
+struct histogram
+{
+	long value;
+	long count;
+};
+
+struct geometry
+{
+	int volume_block_size;
+	int block_pointer_size;
+	int checksum_size;
+	long blocks;
+	long bytes;
+	long reads;
+	/* What --auto-geometry asked us to minimize, then what breaks ties */
+	long primary;
+	long secondary;
+};
+
+/* values is NULL while we are only counting */
+struct sample
+{
+	long* values;
+	long count;
+};
+
+void sample_files(struct sample* s, struct folders* a)
+{
+	struct files* f;
+	while(NULL != a)
+	{
+		f = a->f;
+		while(NULL != f)
+		{
+			if(NULL != s->values) s->values[s->count] = divide_round_up(f->size, SMALLEST_BLOCK);
+			s->count = s->count + 1;
+			f = f->next;
+		}
+		sample_files(s, a->sub);
+		a = a->next;
+	}
+}
+
+void sample_fanouts(struct sample* s, struct folders* a)
+{
+	while(NULL != a)
+	{
+		if(NULL != s->values) s->values[s->count] = files_count(a->f) + folders_count(a->sub);
+		s->count = s->count + 1;
+		sample_fanouts(s, a->sub);
+		a = a->next;
+	}
+}
+
+int compare_long(const void* a, const void* b)
+{
+	long x = *(long*)a;
+	long y = *(long*)b;
+	if(x < y) return -1;
+	if(x > y) return 1;
+	return 0;
+}
+
+/* Sort the sample and squash runs of the same value; returns the number of buckets */
+long build_histogram(struct gfk* g, struct sample* s, struct histogram** h)
+{
+	long i = 0;
+	long buckets = 0;
+	qsort(s->values, s->count, sizeof(long), compare_long);
+	*h = calloc(s->count + 1, sizeof(struct histogram));
+	if(NULL == *h) free(s->values);
+	ensure(g, NULL != *h, "histogram allocation failed\n");
+	while(i < s->count)
+	{
+		if((0 == buckets) || ((*h)[buckets - 1].value != s->values[i]))
+		{
+			(*h)[buckets].value = s->values[i];
+			buckets = buckets + 1;
+		}
+		(*h)[buckets - 1].count = (*h)[buckets - 1].count + 1;
+		i = i + 1;
+	}
+	free(s->values);
+	return buckets;
+}
+
+long collect(struct gfk* g, struct histogram** h, void (*walk)(struct sample*, struct folders*))
+{
+	struct sample s;
+	s.values = NULL;
+	s.count = 0;
+	walk(&s, g->filesystem);
+	s.values = calloc(s.count + 1, sizeof(long));
+	ensure(g, NULL != s.values, "histogram allocation failed\n");
+	s.count = 0;
+	walk(&s, g->filesystem);
+	return build_histogram(g, &s, h);
+}
+
+/* With --pack-tails which packed block a tail lands in depends on the tails
+ * before it in its folder, which a histogram of sizes loses. Only the volume
+ * block size matters for that though, so one walk of the tree samples every
+ * block size at once: how many inodes each file needs, and the data and
+ * packed blocks, which no pointer or checksum size changes.
+ */
+struct packed_sample
+{
+	int volume_block_size;
+	struct sample pointers;
+	long data_blocks;
+	long packed_blocks;
+	long tails;
+	long used;
+};
+
+void sample_packed(struct packed_sample* s, int sizes, struct folders* a)
+{
+	struct packed_sample* p;
+	struct files* f;
+	long count;
+	long tail;
+	int i;
+	while(NULL != a)
+	{
+		i = 0;
+		while(i < sizes)
+		{
+			s[i].used = 0;
+			i = i + 1;
+		}
+		f = a->f;
+		while(NULL != f)
+		{
+			i = 0;
+			while(i < sizes)
+			{
+				p = s + i;
+				if(NULL != p->pointers.values)
+				{
+					/* The same split blocks_needed_for_file() and the next fit
+					 * pack_tail() make
+					 */
+					count = divide_round_up(f->size, p->volume_block_size);
+					tail = f->size % p->volume_block_size;
+					p->pointers.values[p->pointers.count] = count;
+					if(0 != tail)
+					{
+						count = count - 1;
+						p->pointers.values[p->pointers.count] = count + 2;
+						p->tails = p->tails + 1;
+						if((0 != p->used) && ((p->used + tail) <= p->volume_block_size))
+						{
+							p->used = p->used + tail;
+						}
+						else
+						{
+							p->used = tail;
+							p->packed_blocks = p->packed_blocks + 1;
+						}
+					}
+					p->data_blocks = p->data_blocks + count;
+				}
+				p->pointers.count = p->pointers.count + 1;
+				i = i + 1;
+			}
+			f = f->next;
+		}
+		sample_packed(s, sizes, a->sub);
+		a = a->next;
+	}
+}
+
+/* For one volume block size */
+struct packed_plan
+{
+	struct histogram* pointers;
+	long buckets;
+	long data_blocks;
+	long packed_blocks;
+	long tails;
+};
+
+void collect_packed(struct gfk* g, int* block_sizes, struct packed_plan* plans, int sizes)
+{
+	struct packed_sample* s = calloc(sizes, sizeof(struct packed_sample));
+	ensure(g, NULL != s, "histogram allocation failed\n");
+	long files;
+	int i = 0;
+
+	s[0].volume_block_size = block_sizes[0];
+	sample_packed(s, 1, g->filesystem);
+	files = s[0].pointers.count;
+	while(i < sizes)
+	{
+		s[i].volume_block_size = block_sizes[i];
+		s[i].pointers.count = 0;
+		s[i].pointers.values = calloc(files + 1, sizeof(long));
+		if(NULL == s[i].pointers.values)
+		{
+			while(0 < i)
+			{
+				i = i - 1;
+				free(s[i].pointers.values);
+			}
+			free(s);
+			fail(g, "histogram allocation failed\n");
+		}
+		i = i + 1;
+	}
+	sample_packed(s, sizes, g->filesystem);
+
+	i = 0;
+	while(i < sizes)
+	{
+		plans[i].buckets = build_histogram(g, &s[i].pointers, &plans[i].pointers);
+		plans[i].data_blocks = s[i].data_blocks;
+		plans[i].packed_blocks = s[i].packed_blocks;
+		plans[i].tails = s[i].tails;
+		i = i + 1;
+	}
+	free(s);
+}
+
+/* The same arithmetic as blocks_needed_for_folders() but once per distinct fan-out */
+long evaluate_folders(struct gfk* g, struct histogram* folders, long folder_buckets)
+{
+	long total = 0;
+	long bottom;
+	long i = 0;
+
+	while(i < folder_buckets)
+	{
+		bottom = directory_blocks_needed(g, folders[i].value);
+		total = total + (folders[i].count * (1 + bottom + indirect_blocks_needed(g, bottom)));
+		i = i + 1;
+	}
+	/* Root is the one folder without a name block */
+	return total - 1;
+}
+
+/* The same arithmetic as blocks_needed_for_folders() but once per distinct size */
+long evaluate(struct gfk* g, struct histogram* files, long file_buckets, struct histogram* folders, long folder_buckets)
+{
+	long total = 0;
+	long count;
+	long bottom;
+	long i = 0;
+
+	while(i < file_buckets)
+	{
+		count = divide_round_up(files[i].value, g->volume_block_size / SMALLEST_BLOCK);
+		bottom = file_blocks_needed(g, count);
+		total = total + (files[i].count * (1 + count + bottom + indirect_blocks_needed(g, bottom)));
+		i = i + 1;
+	}
+	return total + evaluate_folders(g, folders, folder_buckets);
+}
+
+/* Likewise with the data and packed blocks already counted by collect_packed() */
+long evaluate_packed(struct gfk* g, struct packed_plan* plan, struct histogram* folders, long folder_buckets)
+{
+	long total = plan->data_blocks + plan->packed_blocks;
+	long bottom;
+	long i = 0;
+
+	while(i < plan->buckets)
+	{
+		bottom = file_blocks_needed(g, plan->pointers[i].value);
+		total = total + (plan->pointers[i].count * (1 + bottom + indirect_blocks_needed(g, bottom)));
+		i = i + 1;
+	}
+	return total + evaluate_folders(g, folders, folder_buckets);
+}
+
+int compare_geometry(const void* a, const void* b)
+{
+	struct geometry* x = (struct geometry*)a;
+	struct geometry* y = (struct geometry*)b;
+	long primary = x->primary - y->primary;
+	long secondary = x->secondary - y->secondary;
+	if(0 > primary) return -1;
+	if(0 < primary) return 1;
+	if(0 > secondary) return -1;
+	if(0 < secondary) return 1;
+	return 0;
+}
+
+void use_geometry(struct gfk* g, int vbs, int bps, int cs)
+{
+	g->volume_block_size = vbs;
+	g->block_pointer_size = bps;
+	g->checksum_size = cs;
+	g->inode_size = g->block_pointer_size + (g->checksum_size / 8);
+	g->dnode_size = (g->inode_size << 1) + g->file_size_size;
+}
+
+void print_geometry(struct gfk* g, struct geometry* candidate)
+{
+	fputs("  --volume-block-size ", stdout);
+	fputs(int2str(candidate->volume_block_size, 10, FALSE), stdout);
+	fputs(" --block-pointer-size ", stdout);
+	fputs(int2str(candidate->block_pointer_size, 10, FALSE), stdout);
+	fputs(" --checksum-block-size ", stdout);
+	fputs(int2str(candidate->checksum_size, 10, FALSE), stdout);
+	fputs(": ", stdout);
+	fput_long(candidate->blocks, stdout);
+	fputs(" blocks, ", stdout);
+	fput_long(candidate->bytes, stdout);
+	fputs(" bytes", stdout);
+	if(GEOMETRY_READS == g->auto_geometry)
+	{
+		fputs(", ", stdout);
+		fput_long(candidate->reads, stdout);
+		fputs(" reads", stdout);
+	}
+	fputs("\n", stdout);
+}
+
+/* Try every geometry the standard allows and keep the cheapest; 64bit
+ * pointers only ever win once the volume outgrows 32bit ones
+ */
+void choose_geometry(struct gfk* g)
+{
+	int block_sizes[2] = {512, 4096};
+	int pointer_sizes[3] = {2, 4, 8};
+	int checksum_sizes[2] = {16, 32};
+	int checksum_choices = 2;
+	struct geometry candidates[12];
+	struct histogram* files;
+	struct histogram* folders;
+	struct packed_plan packed[2];
+	int count = 0;
+	int b;
+	int p;
+	int c;
+
+	long start = stats_start(g);
+	long file_buckets = 0;
+	long folder_buckets = collect(g, &folders, sample_fanouts);
+	files = NULL;
+	if(g->pack_tails) collect_packed(g, block_sizes, packed, 2);
+	else file_buckets = collect(g, &files, sample_files);
+
+	/* Only the BSD checksum comes in sizes we can pick between */
+	if(1 != g->checksum_mode)
+	{
+		checksum_sizes[0] = g->checksum_size;
+		if(0 == g->checksum_mode) checksum_sizes[0] = 0;
+		checksum_choices = 1;
+	}
+
+	b = 0;
+	while(b < 2)
+	{
+		p = 0;
+		while(p < 3)
+		{
+			c = 0;
+			while(c < checksum_choices)
+			{
+				use_geometry(g, block_sizes[b], pointer_sizes[p], checksum_sizes[c]);
+				if((g->dnode_size << 2) <= g->volume_block_size)
+				{
+					candidates[count].volume_block_size = g->volume_block_size;
+					candidates[count].block_pointer_size = g->block_pointer_size;
+					candidates[count].checksum_size = g->checksum_size;
+					/* Plus the superblock; reading every file reads every block
+					 * once, except a packed block is read again for each tail in it
+					 */
+					if(g->pack_tails)
+					{
+						candidates[count].blocks = evaluate_packed(g, packed + b, folders, folder_buckets) + 1;
+						candidates[count].reads = candidates[count].blocks - packed[b].packed_blocks + packed[b].tails;
+					}
+					else
+					{
+						candidates[count].blocks = evaluate(g, files, file_buckets, folders, folder_buckets) + 1;
+						candidates[count].reads = candidates[count].blocks;
+					}
+					/* The MBR and leadblock push the first volume block out by whole blocks */
+					candidates[count].bytes = (first_volume_block(g) + candidates[count].blocks) * g->volume_block_size;
+					candidates[count].primary = candidates[count].bytes;
+					candidates[count].secondary = candidates[count].blocks;
+					if(GEOMETRY_READS == g->auto_geometry)
+					{
+						candidates[count].primary = candidates[count].reads;
+						candidates[count].secondary = candidates[count].bytes;
+					}
+					/* Short pointers have to be able to reach every block, the same
+					 * limit build_image() enforces; blocks already counts the superblock
+					 */
+					if((8 == g->block_pointer_size) || (0 == ((first_volume_block(g) + candidates[count].blocks) >> (g->block_pointer_size << 3))))
+					{
+						count = count + 1;
+					}
+				}
+				c = c + 1;
+			}
+			p = p + 1;
+		}
+		b = b + 1;
+	}
+	free(files);
+	free(folders);
+	b = 0;
+	while(g->pack_tails && (b < 2))
+	{
+		free(packed[b].pointers);
+		b = b + 1;
+	}
+	ensure(g, 0 < count, "no legal geometry can hold these files\n");
+
+	qsort(candidates, count, sizeof(struct geometry), compare_geometry);
+	if(!g->quiet_mode) fputs("auto geometry candidates, best first:\n", stdout);
+	c = 0;
+	while((c < count) && !g->quiet_mode)
+	{
+		print_geometry(g, candidates + c);
+		c = c + 1;
+	}
+
+	use_geometry(g, candidates[0].volume_block_size, candidates[0].block_pointer_size, candidates[0].checksum_size);
+	stats_stop(g, STAT_PHASE_PLAN, start);
+}
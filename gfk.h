@@ -0,0 +1,73 @@
+/* Copyright (C) 2022 Jeremiah Orians
+ * This file is part of GFK
+ *
+ * GFK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GFK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GFK If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* libgfk: build GFK images without spawning gfk-create or touching temp files
+ *
+ *	struct gfk* g = gfk_new();
+ *	gfk_option(g, "--quiet", NULL);
+ *	gfk_option(g, "-vbs", "512");
+ *	gfk_add_buffer(g, "etc/motd", text, strlen(text));
+ *	gfk_output_buffer(g, image, sizeof(image));
+ *	long size = gfk_build(g);
+ *	gfk_free(g);
+ *
+ * Each builder owns all of its state so any number can be alive (and building)
+ * at once from different threads; just don't use one builder from two threads
+ * at the same time. Anything that goes wrong comes back as -1 with the reason
+ * in gfk_error() rather than ending the process.
+ */
+
+#ifndef GFK_H
+#define GFK_H
+
+struct gfk;
+
+/* NULL if there wasn't the memory for it */
+struct gfk* gfk_new();
+void gfk_free(struct gfk* g);
+
+/* Takes the same options as gfk-create (value is NULL for flags); returns how
+ * many of option and value it used, zero if it isn't an image option and -1
+ * if the value isn't valid
+ */
+int gfk_option(struct gfk* g, char* option, char* value);
+
+/* path is where the file goes in the image; returns zero or -1 if it can't be read */
+int gfk_add_path(struct gfk* g, char* path);
+
+/* data is not copied and must stay put until gfk_free(); returns zero or -1 */
+int gfk_add_buffer(struct gfk* g, char* path, char* data, long size);
+
+/* Pick one; the last one set wins */
+void gfk_output_path(struct gfk* g, char* name);
+void gfk_output_fd(struct gfk* g, int fd);
+int gfk_output_memfd(struct gfk* g);
+void gfk_output_buffer(struct gfk* g, char* buffer, long capacity);
+
+/* Returns the size of the image in bytes or -1 if it couldn't be built or
+ * didn't fit in the output buffer, in which case gfk_image_size() says how big
+ * it needs to be
+ */
+long gfk_build(struct gfk* g);
+long gfk_image_size(struct gfk* g);
+
+/* Why the last call on g returned -1; NULL if it didn't fail (which includes
+ * an image that was simply too big for the output buffer)
+ */
+char* gfk_error(struct gfk* g);
+
+#endif
@@ -17,22 +17,17 @@
 
 #include "gfk_create.h"
 
+/* A thin wrapper over libgfk; only the options that aren't about the image
+ * itself (or need the whole process) are handled here
+ */
 int main(int argc, char** argv)
 {
 	char* hold;
-	BigByteEndian = TRUE;
-	BigBitEndian = TRUE;
-	MBR = NULL;
-	filesystem = calloc(1, sizeof(struct folders));
-	filesystem->name = "/";
-
-	/* Assume GFK defaults */
-	checksum_mode = 1;
-	checksum_size = 32;
-	native_block_size = 512;
-	volume_block_size = 4096;
-	block_pointer_size = 4;
-	file_size_size = 4;
+	char* output_name = NULL;
+	int used;
+	struct gfk* g = gfk_new();
+	require(NULL != g, "calloc failed in gfk_new\n");
+	stats_init(g, argv);
 
 	int option_index = 1;
 	while(option_index <= argc)
@@ -41,234 +36,98 @@ int main(int argc, char** argv)
 		{
 			option_index = option_index + 1;
 		}
-		else if(match(argv[option_index], "--big-byte-endian"))
-		{
-			BigByteEndian = TRUE;
-			option_index = option_index + 1;
-		}
-		else if(match(argv[option_index], "--big-bit-endian"))
+		else if(match(argv[option_index], "--stats"))
 		{
-			BigByteEndian = TRUE;
+			g->stats_mode = STATS_TEXT;
 			option_index = option_index + 1;
 		}
-		else if(match(argv[option_index], "--little-byte-endian"))
+		else if(match(argv[option_index], "--stats=json"))
 		{
-			BigByteEndian = FALSE;
+			g->stats_mode = STATS_JSON;
 			option_index = option_index + 1;
 		}
-		else if(match(argv[option_index], "--little-bit-endian"))
+		else if(match(argv[option_index], "--progress"))
 		{
-			BigByteEndian = FALSE;
+			g->progress_mode = TRUE;
 			option_index = option_index + 1;
 		}
-		else if(match(argv[option_index], "--file") || match(argv[option_index], "-f"))
-		{
-			hold = argv[option_index+1];
-			require(NULL != hold, "the option --file needs to get a file name to work\n");
-			process_file(hold);
-			option_index = option_index + 2;
-		}
-		else if(match(argv[option_index], "--output") || match(argv[option_index], "-o"))
-		{
-			hold = argv[option_index+1];
-			require(NULL != hold, "the option --output needs to get a file name to work\n");
-			output = fopen(hold, "w");
-			require(NULL != output, "unable to open output file for writing\n");
-			option_index = option_index + 2;
-		}
-		else if(match(argv[option_index], "--master-boot-record") || match(argv[option_index], "-mbr"))
+		else if(match(argv[option_index], "--variant"))
 		{
 			hold = argv[option_index+1];
-			require(NULL != hold, "the option --master-boot-record needs to get a file name to work\n");
-			MBR = hold;
+			require(NULL != hold, "the option --variant needs to get a variant spec to work\n");
+			add_variant(g, hold);
 			option_index = option_index + 2;
 		}
-		else if(match(argv[option_index], "--native-block-size") || match(argv[option_index], "-nbs"))
-		{
-			hold = argv[option_index+1];
-			require(NULL != hold, "the option --native-block-size needs to get an integer to work\n");
-			native_block_size = strtoint(hold);
-			require(64 < native_block_size, "we don't support native block sizes smaller than 64bytes\n");
-			option_index = option_index + 2;
-		}
-		else if(match(argv[option_index], "--volume-block-size") || match(argv[option_index], "-vbs"))
+		else if(match(argv[option_index], "--file") || match(argv[option_index], "-f"))
 		{
 			hold = argv[option_index+1];
-			require(NULL != hold, "the option --volume-block-size needs to get an integer to work\n");
-			volume_block_size = strtoint(hold);
-			require(64 < volume_block_size, "we don't support volume block sizes smaller than 64bytes\n");
+			require(NULL != hold, "the option --file needs to get a file name to work\n");
+			if(0 != gfk_add_path(g, hold))
+			{
+				fputs(gfk_error(g), stderr);
+				exit(EXIT_FAILURE);
+			}
 			option_index = option_index + 2;
 		}
-		else if(match(argv[option_index], "--checksum-algorithm") || match(argv[option_index], "-ca"))
+		else if(match(argv[option_index], "--max-memory"))
 		{
 			hold = argv[option_index+1];
-			require(NULL != hold, "the option --checksum-algorithm needs to get an integer to work\n");
-			checksum_mode = strtoint(hold);
+			require(NULL != hold, "the option --max-memory needs to get a number of bytes to work\n");
+			g->max_memory = strtol(hold, NULL, 0);
+			require(65536 <= g->max_memory, "--max-memory needs at least 64KB to work with\n");
+			require(0 == g->stats.files_ingested, "--max-memory has to come before any --file or --file-list\n");
 			option_index = option_index + 2;
 		}
-		else if(match(argv[option_index], "--checksum-block-size") || match(argv[option_index], "-cs"))
+		else if(match(argv[option_index], "--file-list"))
 		{
 			hold = argv[option_index+1];
-			require(NULL != hold, "the option --checksum-block-size needs to get an integer to work\n");
-			checksum_size = strtoint(hold);
-			require(0 != checksum_size, "a checksum size of zero isn't valid\nIf you wish to disable checksums change the algorithm to zero\n");
+			require(NULL != hold, "the option --file-list needs to get a file name to work\n");
+			process_file_list(g, hold);
 			option_index = option_index + 2;
 		}
-		else if(match(argv[option_index], "--file-size-block-size") || match(argv[option_index], "-fsbs"))
+		else if(match(argv[option_index], "--output") || match(argv[option_index], "-o"))
 		{
 			hold = argv[option_index+1];
-			require(NULL != hold, "the option --file-size-block-size needs to get an integer to work\n");
-			file_size_size = strtoint(hold);
-			require(0 < file_size_size, "zero bytes can't encode any file size info\nNot valid\n");
+			require(NULL != hold, "the option --output needs to get a file name to work\n");
+			output_name = hold;
 			option_index = option_index + 2;
 		}
-		else if(match(argv[option_index], "--block-pointer-size") || match(argv[option_index], "-bps"))
-		{
-			hold = argv[option_index+1];
-			require(NULL != hold, "the option --checksum-size needs to get an integer to work\n");
-			checksum_size = strtoint(hold);
-		}
 		else
 		{
-			fputs("Unknown option\n", stderr);
-			exit(EXIT_FAILURE);
+			used = gfk_option(g, argv[option_index], argv[option_index+1]);
+			if(0 > used)
+			{
+				fputs(gfk_error(g), stderr);
+				exit(EXIT_FAILURE);
+			}
+			else if(0 == used)
+			{
+				fputs("Unknown option\n", stderr);
+				exit(EXIT_FAILURE);
+			}
+			option_index = option_index + used;
 		}
 	}
 
-	require(NULL != output, "You must set an --output file\n");
-
-	/* Setup our first buffer */
-	allocated = create_buffer(NULL, native_block_size);
-	remove_buffer(allocated);
-
-	/* Sanity check checksum combos */
-	if(0 == checksum_mode)
+	if(0 != g->max_memory)
 	{
-		fputs("the NULL algorithm is not to be generated\n", stdout);
-		fputs("Disabling checksuming in output filesystem\n", stdout);
-		checksum_size = 0;
+		/* Both of these walk the whole in memory tree */
+		require(NULL == g->variants, "--max-memory can't be combined with --variant\n");
+		require(GEOMETRY_OFF == g->auto_geometry, "--max-memory can't be combined with --auto-geometry\n");
 	}
-	else if(1 == checksum_mode)
-	{
-		if(16 == checksum_size)
-		{
-			fputs("Using BSD checksum 16bit mode\n", stdout);
-		}
-		else if(32 == checksum_size)
-		{
-			fputs("Using BSD checksum 32bit mode\n", stdout);
-		}
-		else if(64 == checksum_size)
-		{
-			fputs("You have selected BSD checksum 64bit mode\n", stdout);
-			fputs("Although this mode is entirely valid\n", stdout);
-			fputs("This tool doesn't actually support it\n", stdout);
-			fputs("Sorry\n", stdout);
-			exit(EXIT_FAILURE);
-		}
-		else
-		{
-			fputs("You have selected an invalid checksum size for the BSD checksum\n", stdout);
-			fputs("The only officially valid sizes are 16, 32 or 64bits\n", stdout);
-			exit(EXIT_FAILURE);
-		}
-	}
-	else if(2 == checksum_mode)
-	{
-		if(128 == checksum_size)
-		{
-			fputs("You have selected MD5 checksum 128bit mode\n", stdout);
-			fputs("Although this mode is entirely valid\n", stdout);
-			fputs("This tool doesn't actually support it\n", stdout);
-			fputs("Sorry\n", stdout);
-			exit(EXIT_FAILURE);
-		}
-		else
-		{
-			fputs("You have selected an invalid checksum size for the MD5 checksum\n", stdout);
-			fputs("The only officially valid size is 128bits\n", stdout);
-			exit(EXIT_FAILURE);
-		}
-	}
-	else if(3 == checksum_mode)
-	{
-		if(160 == checksum_size)
-		{
-			fputs("You have selected SHA-1 checksum 160bit mode\n", stdout);
-			fputs("Although this mode is entirely valid\n", stdout);
-			fputs("This tool doesn't actually support it\n", stdout);
-			fputs("Sorry\n", stdout);
-			exit(EXIT_FAILURE);
-		}
-		else
-		{
-			fputs("You have selected an invalid checksum size for the SHA-1 checksum\n", stdout);
-			fputs("The only officially valid size is 160bits\n", stdout);
-			exit(EXIT_FAILURE);
-		}
-	}
-	else if(4 == checksum_mode)
-	{
-		if(224 == checksum_size)
-		{
-			fputs("You have selected SHA-2 checksum 2248bit mode\n", stdout);
-		}
-		else if(256 == checksum_size)
-		{
-			fputs("You have selected SHA-2 checksum 256bit mode\n", stdout);
-			exit(EXIT_FAILURE);
-		}
-		else if(384 == checksum_size)
-		{
-			fputs("You have selected SHA-2 checksum 384bit mode\n", stdout);
-			exit(EXIT_FAILURE);
-		}
-		else if(512 == checksum_size)
-		{
-			fputs("You have selected SHA-2 checksum 512bit mode\n", stdout);
-			exit(EXIT_FAILURE);
-		}
-		else
-		{
-			fputs("You have selected an invalid checksum size for the MD5 checksum\n", stdout);
-			fputs("The only officially valid sizes are 224, 256, 384 and 512bits\n", stdout);
-			exit(EXIT_FAILURE);
-		}
-		fputs("Although this mode is entirely valid\n", stdout);
-		fputs("This tool doesn't actually support it\n", stdout);
-		fputs("Sorry\n", stdout);
-		exit(EXIT_FAILURE);
-	}
-	else
+
+	if(NULL != g->variants)
 	{
-		fputs("You have selected an entirely undefined checksum id\n", stdout);
-		fputs("Congrats, that isn't valid and I'm not supporting that\n", stdout);
-		fputs("Goodbye\n", stdout);
-		exit(EXIT_FAILURE);
+		/* Each variant brings its own output */
+		return build_variants(g);
 	}
 
-	inode_size = block_pointer_size + (checksum_size / 8);
-	dnode_size = (inode_size << 1) + file_size_size;
-	require((dnode_size << 2) <= volume_block_size, "block size is too small\n");
-
-	/* Sanity warning message */
-	if(NULL == MBR)
+	require(NULL != output_name, "You must set an --output file\n");
+	gfk_output_path(g, output_name);
+	if(0 > gfk_build(g))
 	{
-		fputs("You didn't set an MBR\n", stderr);
-		fputs("I really hope you know what you are doing\n", stderr);
-		fputs("Because this probably isn't going to work\n", stderr);
+		fputs(gfk_error(g), stderr);
+		exit(EXIT_FAILURE);
 	}
-
-	int volume_blocks_needed = blocks_needed_for_folders(filesystem);
-	fputs("projected block need: ", stdout);
-	fputs(int2str(volume_blocks_needed, 10, FALSE), stdout);
-	fputs(" blocks to write these files\n", stdout);
-
-	/* Write the MBR which is always the first sector */
-	write_MBR();
-
-	/* Write our leadblock which is always the second sector */
-	write_leadblock();
-
 	return EXIT_SUCCESS;
 }
@@ -16,31 +16,176 @@
  */
 
 #include "M2libc/bootstrappable.h"
+#include "gfk.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <setjmp.h>
 
 #define FILE_TAG 0b100
 #define FILE_INDIRECT_TAG 0b101
 #define FOLDER_TAGE 0b10
 #define FOLDER_INDIRECT_TAG 0b11
 
+/* What every pass over the tree counts; one set per builder */
+#define STATS_OFF 0
+#define STATS_TEXT 1
+#define STATS_JSON 2
+
+#define STAT_PHASE_STAT 0
+#define STAT_PHASE_READ 1
+#define STAT_PHASE_CHECKSUM 2
+#define STAT_PHASE_WRITE 3
+#define STAT_PHASE_TREE 4
+#define STAT_PHASE_PLAN 5
+#define STAT_PHASE_FSYNC 6
+#define STAT_PHASE_COUNT 7
+
+struct statistics
+{
+	long files_ingested;
+	long bytes_ingested;
+	long bytes_read;
+	long bytes_written;
+	long write_calls;
+	long data_blocks;
+	long file_blocks;
+	long indirect_file_blocks;
+	long directory_blocks;
+	long indirect_directory_blocks;
+	long packed_blocks;
+	long name_blocks;
+	long buffer_allocations;
+	long buffers_in_use;
+	long buffers_peak;
+	long phase_time[STAT_PHASE_COUNT];
+	long started;
+	long last_progress;
+};
+
+struct inode;
+struct dnode;
+
+/* A builder; everything a build reads or writes lives in here and is handed to
+ * every function (and pool job) that needs it, so builders share nothing
+ */
+struct gfk
+{
+	/* The image options */
+	int native_block_size;
+	int volume_block_size;
+	int checksum_mode;
+	int checksum_size;
+	int block_pointer_size;
+	int file_size_size;
+	int BigByteEndian;
+	int BigBitEndian;
+	char* MBR;
+	int direct_mode;
+	int pack_tails;
+	int auto_geometry;
+	int pool_threads;
+	int prefetch_files;
+	long prefetch_budget;
+	long max_memory;
+	int quiet_mode;
+	int stats_mode;
+	int progress_mode;
+
+	/* Where the image goes; only one of these is used */
+	char* output_name;
+	int output_fd;
+	int output_truncate;
+	char* output_buffer;
+	long output_capacity;
+	long image_size;
+
+	/* The tree and every string it points into */
+	struct folders* filesystem;
+	char** strings;
+	long string_count;
+	long string_capacity;
+	struct statistics stats;
+
+	/* Worked out by build_image() from the options */
+	int inode_size;
+	int dnode_size;
+	void (*put_address)(char* s, unsigned long value);
+	void (*put_checksum)(char* s, unsigned long value);
+	void (*put_file_size)(char* s, unsigned long value);
+	void (*put_slice)(char* s, unsigned long value);
+	void (*encode_inodes)(struct gfk* g, char* s, struct inode* in, int count);
+	void (*encode_dnodes)(struct gfk* g, char* s, struct dnode* in, int count);
+
+	/* Only alive while building */
+	long next_block;
+	struct buffers* allocated;
+	int write_fd;
+	int buffer_alignment;
+	struct pool* pool;
+	struct prefetch* prefetch;
+	struct packing* packing;
+	struct streaming* streaming;
+	struct external* external;
+
+	/* Only the command line builds several images at once, see variants.c */
+	struct variants* variants;
+	int variant_count;
+	struct statistics* variant_stats;
+
+	/* The first thing that went wrong; see fail() */
+	int failed;
+	char* error;
+};
+
+struct inode
+{
+	unsigned long address;
+	unsigned long checksum;
+};
+
+struct dnode
+{
+	struct inode name;
+	struct inode contents;
+	unsigned long size;
+};
+
 struct files
 {
 	char* name;
-	int size;
-	int blocks_needed;
-	FILE* f;
+	long size;
+	long blocks_needed;
+	/* Inputs are only held open while the prefetcher is near them */
+	char* path;
+	int fd;
+	char* data;
 	struct files* next;
+	/* Filled in while writing */
+	struct folders* parent;
+	long address;
+	int written;
+	struct inode name_inode;
+	struct inode root;
 };
 
 struct folders
 {
 	char* name;
-	int blocks_needed;
+	long blocks_needed;
 	struct files* f;
 	struct folders* sub;
 	struct folders* next;
+	/* Filled in while writing */
+	struct folders* parent;
+	long address;
+	long pending;
+	struct inode name_inode;
+	struct inode root;
 };
 
 struct buffers
@@ -53,25 +198,104 @@ struct buffers
 	struct buffers* next;
 };
 
-extern int disk_block_count;
-extern struct buffers* allocated;
-extern int native_block_size;
-extern int volume_block_size;
-extern int inode_size;
-extern int dnode_size;
-extern int checksum_mode;
-extern int checksum_size;
-extern int block_pointer_size;
-extern int file_size_size;
-extern int BigByteEndian;
-extern int BigBitEndian;
-extern char* MBR;
-extern struct folders* filesystem;
-extern FILE* output;
-
-struct buffers* create_buffer(struct buffers* a, int size);
-void remove_buffer(struct buffers* a);
-void process_file(char* s);
-int blocks_needed_for_folders(struct folders* a);
-void write_MBR();
-void write_leadblock();
+struct variants
+{
+	char* output;
+	int index;
+	int volume_block_size;
+	int native_block_size;
+	int block_pointer_size;
+	int checksum_mode;
+	int checksum_size;
+	int BigByteEndian;
+	int pid;
+	int failed;
+	struct variants* next;
+};
+
+#define FEATURE_CHECKSUM 1
+#define FEATURE_DEDUPLICATION 2
+#define FEATURE_PACKED_TAILS 4
+
+#define GEOMETRY_OFF 0
+#define GEOMETRY_SIZE 1
+#define GEOMETRY_READS 2
+
+extern __thread jmp_buf* unwind;
+
+void fail(struct gfk* g, char* message);
+void ensure(struct gfk* g, int condition, char* message);
+struct buffers* create_buffer(struct gfk* g, struct buffers* a, int size);
+void remove_buffer(struct gfk* g, struct buffers* a);
+void free_buffers(struct buffers* a);
+void close_input(struct files* f);
+void process_file(struct gfk* g, char* s);
+void place_file(struct gfk* g, struct files* f, char* s);
+void process_file_list(struct gfk* g, char* name);
+void check_names(struct gfk* g, struct folders* a);
+void external_add(struct gfk* g, char* s, long size);
+long external_blocks_needed(struct gfk* g);
+void write_external(struct gfk* g, struct inode* root);
+void external_free(struct gfk* g);
+long blocks_needed_for_file(struct gfk* g, long size, long* packed);
+long feature_flags(struct gfk* g);
+long get_free_block(struct gfk* g);
+long get_free_blocks(struct gfk* g, long count);
+long blocks_needed_for_folders(struct gfk* g, struct folders* a);
+long files_count(struct files* a);
+long folders_count(struct folders* a);
+long divide_round_up(long count, long per_block);
+long indirect_blocks_needed(struct gfk* g, long bottom);
+long blocks_needed_for_file_data(struct gfk* g, long size);
+long file_blocks_needed(struct gfk* g, long count);
+long directory_blocks_needed(struct gfk* g, long dnodes);
+void choose_geometry(struct gfk* g);
+int max_inodes(struct gfk* g);
+int max_dnodes(struct gfk* g);
+long first_volume_block(struct gfk* g);
+void write_MBR(struct gfk* g);
+void write_leadblock(struct gfk* g, long volume_blocks_needed);
+void write_superblock(struct gfk* g, struct inode* root);
+long checksum_block(struct gfk* g, char* block);
+void emit_block(struct gfk* g, char* block, long address, struct inode* out);
+void write_name_block(struct gfk* g, char* name, long address, char* block, struct inode* out);
+void write_directory_blocks(struct gfk* g, struct dnode* dnodes, long count, long address, char* block, struct inode* root);
+void write_indirect_levels(struct gfk* g, struct inode* level, long count, long address, int tag, char* block, struct inode* root);
+void write_file_data(struct gfk* g, struct files* f, int (*next)(struct gfk*, struct files*, char*));
+void close_packed_block(struct gfk* g);
+int held_by_packed_block(struct gfk* g, struct files* f);
+void write_filesystem(struct gfk* g, long volume_blocks_needed);
+void free_writer(struct gfk* g);
+void pool_start(struct gfk* g);
+void pool_submit(struct gfk* g, void (*run)(struct gfk* g, void* item), void* item);
+void pool_wait(struct gfk* g);
+void pool_wait_for(struct gfk* g, int* flag);
+void pool_stop(struct gfk* g);
+struct buffers* pool_buffers(struct gfk* g);
+void setup_output(struct gfk* g, int fd);
+void open_output(struct gfk* g, char* name);
+void setup_output_buffer(struct gfk* g);
+void write_at(struct gfk* g, char* s, int size, long offset);
+void leave_direct_mode(struct gfk* g, char* reason);
+void build_image(struct gfk* g);
+void add_variant(struct gfk* g, char* spec);
+int build_variants(struct gfk* g);
+void prefetch_share(struct gfk* g, struct folders* root, int consumers);
+void prefetch_consumer(struct gfk* g, int index);
+void prefetch_release_consumer(struct gfk* g, int index);
+void prefetch_serve(struct gfk* g, void (*reap)(struct gfk* g));
+void prefetch_start(struct gfk* g, struct folders* root);
+int prefetch_next(struct gfk* g, struct files* f, char* buffer);
+int stream_next(struct gfk* g, struct files* f, char* buffer);
+void prefetch_stop(struct gfk* g);
+void select_encoders(struct gfk* g);
+void stats_init(struct gfk* g, char** argv);
+void stats_clear(struct gfk* g);
+long stats_start(struct gfk* g);
+void stats_stop(struct gfk* g, int phase, long start);
+void stats_buffer_taken(struct gfk* g);
+void stats_buffer_returned(struct gfk* g);
+void stats_progress(struct gfk* g);
+void stats_child(struct gfk* g);
+void stats_merge(struct gfk* g, struct statistics* s);
+void fput_long(long x, FILE* f);
@@ -0,0 +1,180 @@
+/* Copyright (C) 2022 Jeremiah Orians
+ * This file is part of GFK
+ *
+ * GFK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GFK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GFK If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gfk_create.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+/* What the device behind fd considers a sector, zero if we can't tell */
+int detect_native_block_size(int fd)
+{
+	struct stat sb;
+	if(0 != fstat(fd, &sb)) return 0;
+
+	if(S_ISBLK(sb.st_mode))
+	{
+		int sector = 0;
+		if(0 == ioctl(fd, BLKSSZGET, &sector)) return sector;
+		return 0;
+	}
+
+#ifdef STATX_DIOALIGN
+	/* Regular files report what O_DIRECT needs from the filesystem underneath */
+	struct statx sx;
+	if(0 != statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &sx)) return 0;
+	if(0 == (sx.stx_mask & STATX_DIOALIGN)) return 0;
+	return sx.stx_dio_offset_align;
+#else
+	return 0;
+#endif
+}
+
+void report_fallback(char* reason)
+{
+	fputs("O_DIRECT output not possible (", stderr);
+	fputs(reason, stderr);
+	fputs("), falling back to buffered writes\n", stderr);
+}
+
+void fallback_to_buffered(struct gfk* g, char* reason)
+{
+	report_fallback(reason);
+	g->direct_mode = FALSE;
+	g->buffer_alignment = 0;
+}
+
+/* native_block_size of zero means nobody told us so we get to pick */
+void setup_output(struct gfk* g, int fd)
+{
+	int sector = detect_native_block_size(fd);
+	g->write_fd = fd;
+
+	if(0 == g->native_block_size)
+	{
+		struct stat sb;
+		fstat(g->write_fd, &sb);
+		/* Images written to plain files shouldn't depend on the host they were built on */
+		if((0 < sector) && (g->direct_mode || S_ISBLK(sb.st_mode))) g->native_block_size = sector;
+		else g->native_block_size = 512;
+		if(!g->quiet_mode)
+		{
+			fputs("Using native block size of ", stdout);
+			fputs(int2str(g->native_block_size, 10, FALSE), stdout);
+			fputs(" bytes\n", stdout);
+		}
+	}
+
+	if(g->direct_mode)
+	{
+		if(0 == sector) sector = 512;
+		if(0 != (g->native_block_size % sector))
+		{
+			leave_direct_mode(g, "native block size is not a multiple of the device sector");
+		}
+		else
+		{
+			g->buffer_alignment = sector;
+		}
+	}
+}
+
+void open_output(struct gfk* g, char* name)
+{
+	int fd = -1;
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+	if(g->direct_mode)
+	{
+		fd = open(name, flags | O_DIRECT, 0644);
+		if((0 > fd) && (EINVAL == errno))
+		{
+			fallback_to_buffered(g, "the target does not support it");
+		}
+	}
+
+	if(!g->direct_mode)
+	{
+		fd = open(name, flags, 0644);
+	}
+	ensure(g, 0 <= fd, "unable to open output file for writing\n");
+	setup_output(g, fd);
+}
+
+/* Straight into g->output_buffer; the caller already made sure the image fits */
+void setup_output_buffer(struct gfk* g)
+{
+	g->write_fd = -1;
+	g->direct_mode = FALSE;
+	if(0 == g->native_block_size) g->native_block_size = 512;
+}
+
+/* Rare enough that every builder can share it */
+pthread_mutex_t direct_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* For when O_DIRECT can't keep up with where we need to write. Several pool
+ * workers can be refused at once; the first one through switches and the rest
+ * just retry. Buffers keep their alignment, buffered writes don't mind it.
+ */
+void leave_direct_mode(struct gfk* g, char* reason)
+{
+	pthread_mutex_lock(&direct_lock);
+	if(__atomic_load_n(&g->direct_mode, __ATOMIC_ACQUIRE))
+	{
+		if(0 != fcntl(g->write_fd, F_SETFL, fcntl(g->write_fd, F_GETFL) & ~O_DIRECT))
+		{
+			pthread_mutex_unlock(&direct_lock);
+			fail(g, "unable to clear O_DIRECT\n");
+		}
+		report_fallback(reason);
+		__atomic_store_n(&g->direct_mode, FALSE, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&direct_lock);
+}
+
+/* Every block has a fixed home so whichever thread finishes one writes it there */
+void write_at(struct gfk* g, char* s, int size, long offset)
+{
+	long start = stats_start(g);
+	int done = 0;
+	int direct;
+	int r;
+	if(NULL != g->output_buffer)
+	{
+		memcpy(g->output_buffer + offset, s, size);
+		done = size;
+	}
+	while(done < size)
+	{
+		/* Another worker may switch to buffered writes while this one is refused */
+		direct = __atomic_load_n(&g->direct_mode, __ATOMIC_ACQUIRE);
+		r = pwrite(g->write_fd, s + done, size - done, offset + done);
+		if((0 > r) && (EINTR == errno)) continue;
+		if((0 > r) && (EINVAL == errno) && direct && (0 == done))
+		{
+			/* Some filesystems accept O_DIRECT at open and refuse it on write */
+			leave_direct_mode(g, "the target refused a direct write");
+			continue;
+		}
+		ensure(g, 0 < r, "write to output failed\n");
+		done = done + r;
+	}
+	stats_stop(g, STAT_PHASE_WRITE, start);
+	__atomic_add_fetch(&g->stats.write_calls, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&g->stats.bytes_written, size, __ATOMIC_RELAXED);
+}
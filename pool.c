@@ -0,0 +1,338 @@
+/* Copyright (C) 2022 Jeremiah Orians
+ * This file is part of GFK
+ *
+ * GFK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GFK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GFK If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gfk_create.h"
+#include <pthread.h>
+
+/* A work stealing pool for the metadata jobs; every worker keeps its own deque
+ * and works on its newest job (the parent it just made ready is likely still in
+ * cache) while idle workers steal the oldest job from somebody else.
+ * With a single thread there is nothing to share so jobs just run inline.
+ */
+struct jobs
+{
+	void (*run)(struct gfk* g, void* item);
+	void* item;
+};
+
+struct workers
+{
+	pthread_t thread;
+	pthread_mutex_t lock;
+	struct jobs* deque;
+	long capacity;
+	long top;
+	long bottom;
+	struct buffers* scratch;
+	struct gfk* g;
+	int index;
+};
+
+/* queued: sitting in a deque, outstanding: submitted and not yet finished */
+struct pool
+{
+	struct workers* workers;
+	int worker_count;
+	int running;
+	int next_victim;
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle;
+	pthread_cond_t finished;
+	long queued;
+	long outstanding;
+	int waiters;
+	int stopping;
+};
+
+/* Which worker (of whichever builder) this thread is, NULL if it isn't one */
+__thread struct workers* current_worker;
+
+void push_job(struct gfk* g, struct workers* w, void (*run)(struct gfk* g, void* item), void* item)
+{
+	struct jobs* grown;
+	pthread_mutex_lock(&w->lock);
+	if(w->bottom == w->capacity)
+	{
+		/* Slide what is left down before growing; an empty deque (or none
+		 * at all on the first push) has nothing to move
+		 */
+		if((NULL != w->deque) && (w->bottom != w->top))
+		{
+			memmove(w->deque, w->deque + w->top, (w->bottom - w->top) * sizeof(struct jobs));
+		}
+		w->bottom = w->bottom - w->top;
+		w->top = 0;
+		if(w->bottom == w->capacity)
+		{
+			grown = realloc(w->deque, ((w->capacity << 1) + 64) * sizeof(struct jobs));
+			if(NULL == grown)
+			{
+				pthread_mutex_unlock(&w->lock);
+				fail(g, "realloc failed in push_job\n");
+			}
+			w->deque = grown;
+			w->capacity = (w->capacity << 1) + 64;
+		}
+	}
+	w->deque[w->bottom].run = run;
+	w->deque[w->bottom].item = item;
+	w->bottom = w->bottom + 1;
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* The owner takes from the bottom, thieves from the top */
+int take_job(struct workers* w, int own, struct jobs* out)
+{
+	int found = FALSE;
+	pthread_mutex_lock(&w->lock);
+	if(w->top < w->bottom)
+	{
+		if(own)
+		{
+			w->bottom = w->bottom - 1;
+			*out = w->deque[w->bottom];
+		}
+		else
+		{
+			*out = w->deque[w->top];
+			w->top = w->top + 1;
+		}
+		if(w->top == w->bottom)
+		{
+			w->top = 0;
+			w->bottom = 0;
+		}
+		found = TRUE;
+	}
+	pthread_mutex_unlock(&w->lock);
+	return found;
+}
+
+int find_job(struct pool* p, int self, struct jobs* out)
+{
+	int i = 1;
+	if(take_job(p->workers + self, TRUE, out)) return TRUE;
+	while(i < p->worker_count)
+	{
+		if(take_job(p->workers + ((self + i) % p->worker_count), FALSE, out)) return TRUE;
+		i = i + 1;
+	}
+	return FALSE;
+}
+
+/* A job that fails comes back here (see fail()); it has already left the
+ * error in g, so once it is counted as done pool_wait() hands it on
+ */
+void* worker_thread(void* item)
+{
+	struct workers* w = item;
+	struct gfk* g = w->g;
+	struct pool* p = g->pool;
+	struct jobs job;
+	jmp_buf here;
+	current_worker = w;
+	unwind = &here;
+
+	while(TRUE)
+	{
+		if(find_job(p, w->index, &job))
+		{
+			pthread_mutex_lock(&p->idle_lock);
+			p->queued = p->queued - 1;
+			pthread_mutex_unlock(&p->idle_lock);
+
+			if(__atomic_load_n(&g->failed, __ATOMIC_ACQUIRE))
+			{
+				/* Whatever it was for is never getting written */
+			}
+			else if(0 == setjmp(here))
+			{
+				job.run(g, job.item);
+			}
+
+			pthread_mutex_lock(&p->idle_lock);
+			p->outstanding = p->outstanding - 1;
+			if((0 == p->outstanding) || (0 != p->waiters)) pthread_cond_broadcast(&p->finished);
+			pthread_mutex_unlock(&p->idle_lock);
+			continue;
+		}
+
+		pthread_mutex_lock(&p->idle_lock);
+		while((0 == p->queued) && !p->stopping) pthread_cond_wait(&p->idle, &p->idle_lock);
+		if((0 == p->queued) && p->stopping)
+		{
+			pthread_mutex_unlock(&p->idle_lock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&p->idle_lock);
+	}
+}
+
+void pool_start(struct gfk* g)
+{
+	struct pool* p;
+	long i = 0;
+	if(1 >= g->pool_threads) return;
+
+	p = calloc(1, sizeof(struct pool));
+	ensure(g, NULL != p, "calloc failed in pool_start\n");
+	p->workers = calloc(g->pool_threads, sizeof(struct workers));
+	if(NULL == p->workers) free(p);
+	ensure(g, NULL != p->workers, "calloc failed in pool_start\n");
+	p->worker_count = g->pool_threads;
+	pthread_mutex_init(&p->idle_lock, NULL);
+	pthread_cond_init(&p->idle, NULL);
+	pthread_cond_init(&p->finished, NULL);
+	while(i < p->worker_count)
+	{
+		pthread_mutex_init(&p->workers[i].lock, NULL);
+		p->workers[i].g = g;
+		p->workers[i].index = i;
+		i = i + 1;
+	}
+	g->pool = p;
+
+	i = 0;
+	while(i < p->worker_count)
+	{
+		p->workers[i].scratch = create_buffer(g, NULL, g->volume_block_size);
+		remove_buffer(g, p->workers[i].scratch);
+		i = i + 1;
+	}
+
+	/* Counted as they come up so pool_stop() only waits on the ones that did */
+	i = 0;
+	while(i < p->worker_count)
+	{
+		ensure(g, 0 == pthread_create(&p->workers[i].thread, NULL, worker_thread, p->workers + i), "unable to start pool thread\n");
+		p->running = i + 1;
+		i = i + 1;
+	}
+}
+
+/* Workers keep what they make ready; everybody else deals them out in turn.
+ * Once something failed nothing new gets started.
+ */
+void pool_submit(struct gfk* g, void (*run)(struct gfk* g, void* item), void* item)
+{
+	struct pool* p = g->pool;
+	struct workers* w;
+	if(__atomic_load_n(&g->failed, __ATOMIC_ACQUIRE)) return;
+	if(NULL == p)
+	{
+		run(g, item);
+		return;
+	}
+
+	/* Count it before it can be stolen or a thief could take queued below zero */
+	pthread_mutex_lock(&p->idle_lock);
+	p->outstanding = p->outstanding + 1;
+	p->queued = p->queued + 1;
+	if((NULL != current_worker) && (g == current_worker->g))
+	{
+		w = current_worker;
+	}
+	else
+	{
+		w = p->workers + p->next_victim;
+		p->next_victim = (p->next_victim + 1) % p->worker_count;
+	}
+	pthread_mutex_unlock(&p->idle_lock);
+
+	push_job(g, w, run, item);
+
+	pthread_mutex_lock(&p->idle_lock);
+	pthread_cond_signal(&p->idle);
+	pthread_mutex_unlock(&p->idle_lock);
+}
+
+/* Returns once every job (and whatever they submitted) has run; if any of
+ * them failed the caller fails with it
+ */
+void pool_wait(struct gfk* g)
+{
+	struct pool* p = g->pool;
+	if(NULL != p)
+	{
+		pthread_mutex_lock(&p->idle_lock);
+		while(0 != p->outstanding) pthread_cond_wait(&p->finished, &p->idle_lock);
+		pthread_mutex_unlock(&p->idle_lock);
+	}
+	if(__atomic_load_n(&g->failed, __ATOMIC_ACQUIRE)) fail(g, g->error);
+}
+
+/* Returns once some job has set *flag, without waiting on the rest of them;
+ * like pool_wait() the caller fails if anything did
+ */
+void pool_wait_for(struct gfk* g, int* flag)
+{
+	struct pool* p = g->pool;
+	if(NULL != p)
+	{
+		pthread_mutex_lock(&p->idle_lock);
+		p->waiters = p->waiters + 1;
+		while(!__atomic_load_n(flag, __ATOMIC_ACQUIRE) && !__atomic_load_n(&g->failed, __ATOMIC_ACQUIRE))
+		{
+			pthread_cond_wait(&p->finished, &p->idle_lock);
+		}
+		p->waiters = p->waiters - 1;
+		pthread_mutex_unlock(&p->idle_lock);
+	}
+	if(__atomic_load_n(&g->failed, __ATOMIC_ACQUIRE)) fail(g, g->error);
+}
+
+/* Safe to call whatever state a failed build left the pool in */
+void pool_stop(struct gfk* g)
+{
+	struct pool* p = g->pool;
+	int i = 0;
+	if(NULL == p) return;
+
+	pthread_mutex_lock(&p->idle_lock);
+	p->stopping = TRUE;
+	pthread_cond_broadcast(&p->idle);
+	pthread_mutex_unlock(&p->idle_lock);
+
+	while(i < p->running)
+	{
+		pthread_join(p->workers[i].thread, NULL);
+		i = i + 1;
+	}
+
+	/* Only once nobody can still be trying to steal from them */
+	i = 0;
+	while(i < p->worker_count)
+	{
+		free(p->workers[i].deque);
+		free_buffers(p->workers[i].scratch);
+		pthread_mutex_destroy(&p->workers[i].lock);
+		i = i + 1;
+	}
+	pthread_mutex_destroy(&p->idle_lock);
+	pthread_cond_destroy(&p->idle);
+	pthread_cond_destroy(&p->finished);
+	free(p->workers);
+	free(p);
+	g->pool = NULL;
+}
+
+/* The buffer list jobs should borrow from on this thread */
+struct buffers* pool_buffers(struct gfk* g)
+{
+	if((NULL == current_worker) || (g != current_worker->g)) return g->allocated;
+	return current_worker->scratch;
+}
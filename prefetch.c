@@ -0,0 +1,662 @@
+/* Copyright (C) 2022 Jeremiah Orians
+ * This file is part of GFK
+ *
+ * GFK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GFK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GFK If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gfk_create.h"
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <errno.h>
+
+/* When building variants the parent reads everything exactly once into a ring
+ * every child process consumes from; a slot is reused once all of them moved past it.
+ * Chunks are a multiple of every sane volume block size but we cope with any.
+ */
+#define SHARED_CHUNK 65536
+struct shared_ring
+{
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	long head;
+	int slots;
+	int consumers;
+};
+
+struct prefetch
+{
+	/* The files in the exact order the writer will ask for them */
+	struct files** order;
+	long count;
+
+	/* Ring of volume_block_size buffers the reader thread fills ahead of the writer */
+	struct buffers** ring;
+	int* ring_size;
+	int ring_slots;
+	long ring_head;
+	long ring_tail;
+	int reader_running;
+	int reader_failed;
+	int stopping;
+	pthread_t reader;
+	pthread_mutex_t ring_lock;
+	pthread_cond_t ring_not_empty;
+	pthread_cond_t ring_not_full;
+
+	/* Where the writer currently is */
+	long consumer_file;
+	long consumer_offset;
+
+	/* Only for --variant, see prefetch_share() */
+	struct shared_ring* shared;
+	long* shared_tails;
+	int* shared_size;
+	char* shared_data;
+	int shared_consumer;
+	int shared_offset;
+};
+
+/* Made on first use since stream_next() can get by without a plan */
+struct prefetch* prefetch_state(struct gfk* g)
+{
+	if(NULL == g->prefetch)
+	{
+		g->prefetch = calloc(1, sizeof(struct prefetch));
+		ensure(g, NULL != g->prefetch, "prefetch allocation failed\n");
+	}
+	return g->prefetch;
+}
+
+/* Must visit the tree in the same order as write_folder_data() */
+void prefetch_collect(struct prefetch* p, struct folders* a, int counting)
+{
+	struct files* f;
+	while(NULL != a)
+	{
+		f = a->f;
+		while(NULL != f)
+		{
+			if(!counting) p->order[p->count] = f;
+			p->count = p->count + 1;
+			f = f->next;
+		}
+		prefetch_collect(p, a->sub, counting);
+		a = a->next;
+	}
+}
+
+/* Whoever reads a file opens it (at most prefetch_files ahead) and closes it
+ * as soon as the last chunk is in, so only a window of inputs is ever open
+ */
+void open_input(struct gfk* g, struct files* f)
+{
+	char message[PATH_MAX + 160];
+	if((NULL != f->data) || (0 <= f->fd)) return;
+	f->fd = open(f->path, O_RDONLY);
+	if(0 <= f->fd) return;
+	strcpy(message, "unable to open ");
+	strncat(message, f->path, PATH_MAX - 1);
+	strcat(message, " while building the image: ");
+	strncat(message, strerror(errno), 100);
+	strcat(message, "\n");
+	fail(g, message);
+}
+
+void close_input(struct files* f)
+{
+	if(0 > f->fd) return;
+	close(f->fd);
+	f->fd = -1;
+}
+
+void advise_input(struct gfk* g, struct files* f)
+{
+	if(NULL != f->data) return;
+	open_input(g, f);
+	/* Kicks off kernel readahead without blocking us */
+	posix_fadvise(f->fd, 0, f->size, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(f->fd, 0, f->size, POSIX_FADV_WILLNEED);
+}
+
+void advise_file(struct gfk* g, long index)
+{
+	if(index >= g->prefetch->count) return;
+	advise_input(g, g->prefetch->order[index]);
+}
+
+void read_chunk(struct gfk* g, struct files* f, long offset, char* buffer, int size)
+{
+	if(NULL != f->data)
+	{
+		/* Handed to us in memory by the library */
+		memcpy(buffer, f->data + offset, size);
+		return;
+	}
+	open_input(g, f);
+	int done = 0;
+	int r;
+	while(done < size)
+	{
+		r = pread(f->fd, buffer + done, size - done, offset + done);
+		ensure(g, 0 < r, "input file shrank or could not be read while building the image\n");
+		done = done + r;
+	}
+}
+
+int chunk_size(struct gfk* g, struct files* f, long offset)
+{
+	long left = f->size - offset;
+	if(left > g->volume_block_size) return g->volume_block_size;
+	return left;
+}
+
+/* Fill every free slot we can for f with a single preadv */
+int read_slots(struct gfk* g, struct files* f, long offset, long free)
+{
+	struct prefetch* p = g->prefetch;
+	struct iovec vec[64];
+	long left = f->size - offset;
+	int count = 0;
+	int size;
+	int slot;
+	int r;
+	int i;
+
+	while((count < free) && (count < 64) && (0 < left))
+	{
+		slot = (p->ring_head + count) % p->ring_slots;
+		size = g->volume_block_size;
+		if(left < size) size = left;
+		p->ring_size[slot] = size;
+		vec[count].iov_base = p->ring[slot]->buffer;
+		vec[count].iov_len = size;
+		left = left - size;
+		count = count + 1;
+	}
+
+	if(NULL != f->data)
+	{
+		i = 0;
+		while(i < count)
+		{
+			read_chunk(g, f, offset + (i * (long)g->volume_block_size), vec[i].iov_base, vec[i].iov_len);
+			i = i + 1;
+		}
+		return count;
+	}
+
+	open_input(g, f);
+	r = preadv(f->fd, vec, count, offset);
+	ensure(g, 0 < r, "input file shrank or could not be read while building the image\n");
+
+	/* Short reads are rare; just finish them one slot at a time */
+	i = 0;
+	while(r >= (int)vec[i].iov_len)
+	{
+		r = r - vec[i].iov_len;
+		i = i + 1;
+		if(i == count) return count;
+	}
+	read_chunk(g, f, offset + (i * (long)g->volume_block_size) + r, ((char*)vec[i].iov_base) + r, vec[i].iov_len - r);
+	i = i + 1;
+	while(i < count)
+	{
+		read_chunk(g, f, offset + (i * (long)g->volume_block_size), vec[i].iov_base, vec[i].iov_len);
+		i = i + 1;
+	}
+	return count;
+}
+
+void read_ahead(struct gfk* g)
+{
+	struct prefetch* p = g->prefetch;
+	long file = 0;
+	long offset;
+	long free;
+	int count;
+
+	while(file < p->count)
+	{
+		advise_file(g, file + g->prefetch_files);
+		offset = 0;
+		while(offset < p->order[file]->size)
+		{
+			pthread_mutex_lock(&p->ring_lock);
+			while(((p->ring_head - p->ring_tail) >= p->ring_slots) && !p->stopping) pthread_cond_wait(&p->ring_not_full, &p->ring_lock);
+			free = p->ring_slots - (p->ring_head - p->ring_tail);
+			if(p->stopping) free = 0;
+			pthread_mutex_unlock(&p->ring_lock);
+			if(0 == free) return;
+
+			/* Only we touch the slots from ring_head on until we publish them */
+			count = read_slots(g, p->order[file], offset, free);
+			offset = offset + (count * (long)g->volume_block_size);
+
+			pthread_mutex_lock(&p->ring_lock);
+			p->ring_head = p->ring_head + count;
+			pthread_cond_signal(&p->ring_not_empty);
+			pthread_mutex_unlock(&p->ring_lock);
+		}
+		close_input(p->order[file]);
+		file = file + 1;
+	}
+}
+
+/* A read that fails leaves the error in g (see fail()) for the writer to pick up */
+void* reader_thread(void* item)
+{
+	struct gfk* g = item;
+	struct prefetch* p = g->prefetch;
+	jmp_buf here;
+	unwind = &here;
+	if(0 == setjmp(here))
+	{
+		read_ahead(g);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&p->ring_lock);
+	p->reader_failed = TRUE;
+	pthread_cond_signal(&p->ring_not_empty);
+	pthread_mutex_unlock(&p->ring_lock);
+	return NULL;
+}
+
+void prefetch_plan(struct gfk* g, struct folders* root)
+{
+	struct prefetch* p = prefetch_state(g);
+	p->count = 0;
+	prefetch_collect(p, root, TRUE);
+	p->order = calloc(p->count + 1, sizeof(struct files*));
+	ensure(g, NULL != p->order, "prefetch allocation failed\n");
+	p->count = 0;
+	prefetch_collect(p, root, FALSE);
+	p->consumer_file = 0;
+	p->consumer_offset = 0;
+}
+
+long shared_min_tail(struct prefetch* p)
+{
+	long min = p->shared_tails[0];
+	int i = 1;
+	while(i < p->shared->consumers)
+	{
+		if(p->shared_tails[i] < min) min = p->shared_tails[i];
+		i = i + 1;
+	}
+	return min;
+}
+
+/* Must be called before forking the consumers so they all see the same mapping */
+void prefetch_share(struct gfk* g, struct folders* root, int consumers)
+{
+	struct prefetch* p = prefetch_state(g);
+	pthread_mutexattr_t mutex_attributes;
+	pthread_condattr_t cond_attributes;
+	int slots = g->prefetch_budget / SHARED_CHUNK;
+	if(2 > slots) slots = 2;
+
+	long bytes = sizeof(struct shared_ring) + (consumers * sizeof(long)) + (slots * sizeof(int)) + (slots * (long)SHARED_CHUNK);
+	void* map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	ensure(g, MAP_FAILED != map, "unable to map shared prefetch ring\n");
+	p->shared = map;
+	p->shared_tails = (long*)(p->shared + 1);
+	p->shared_size = (int*)(p->shared_tails + consumers);
+	p->shared_data = (char*)(p->shared_size + slots);
+	p->shared->slots = slots;
+	p->shared->consumers = consumers;
+
+	pthread_mutexattr_init(&mutex_attributes);
+	pthread_mutexattr_setpshared(&mutex_attributes, PTHREAD_PROCESS_SHARED);
+	pthread_mutex_init(&p->shared->lock, &mutex_attributes);
+	pthread_condattr_init(&cond_attributes);
+	pthread_condattr_setpshared(&cond_attributes, PTHREAD_PROCESS_SHARED);
+	pthread_cond_init(&p->shared->not_empty, &cond_attributes);
+	pthread_cond_init(&p->shared->not_full, &cond_attributes);
+
+	prefetch_plan(g, root);
+}
+
+/* For the child; which of the shared tails is ours */
+void prefetch_consumer(struct gfk* g, int index)
+{
+	g->prefetch->shared_consumer = index;
+}
+
+/* A consumer that is gone (finished or crashed) must not hold back the others */
+void prefetch_release_consumer(struct gfk* g, int index)
+{
+	struct prefetch* p = g->prefetch;
+	pthread_mutex_lock(&p->shared->lock);
+	p->shared_tails[index] = 0x7FFFFFFFFFFFFFFFL;
+	pthread_cond_broadcast(&p->shared->not_full);
+	pthread_mutex_unlock(&p->shared->lock);
+}
+
+/* The parent side; reads every planned file once, polling reap for dead consumers */
+void prefetch_serve(struct gfk* g, void (*reap)(struct gfk* g))
+{
+	struct prefetch* p = g->prefetch;
+	struct timespec deadline;
+	long file = 0;
+	long offset;
+	long start;
+	int size;
+	int slot;
+	int i = 0;
+
+	while(i < g->prefetch_files)
+	{
+		advise_file(g, i);
+		i = i + 1;
+	}
+
+	while(file < p->count)
+	{
+		advise_file(g, file + g->prefetch_files);
+		offset = 0;
+		while(offset < p->order[file]->size)
+		{
+			pthread_mutex_lock(&p->shared->lock);
+			while((p->shared->head - shared_min_tail(p)) >= p->shared->slots)
+			{
+				clock_gettime(CLOCK_REALTIME, &deadline);
+				deadline.tv_sec = deadline.tv_sec + 1;
+				if(ETIMEDOUT == pthread_cond_timedwait(&p->shared->not_full, &p->shared->lock, &deadline))
+				{
+					pthread_mutex_unlock(&p->shared->lock);
+					reap(g);
+					pthread_mutex_lock(&p->shared->lock);
+				}
+			}
+			pthread_mutex_unlock(&p->shared->lock);
+
+			/* Nobody reads the slot at head until we publish it */
+			slot = p->shared->head % p->shared->slots;
+			size = SHARED_CHUNK;
+			if((p->order[file]->size - offset) < size) size = p->order[file]->size - offset;
+			start = stats_start(g);
+			read_chunk(g, p->order[file], offset, p->shared_data + (slot * (long)SHARED_CHUNK), size);
+			stats_stop(g, STAT_PHASE_READ, start);
+			p->shared_size[slot] = size;
+			offset = offset + size;
+			g->stats.bytes_read = g->stats.bytes_read + size;
+
+			pthread_mutex_lock(&p->shared->lock);
+			p->shared->head = p->shared->head + 1;
+			pthread_cond_broadcast(&p->shared->not_empty);
+			pthread_mutex_unlock(&p->shared->lock);
+			stats_progress(g);
+		}
+		close_input(p->order[file]);
+		file = file + 1;
+	}
+}
+
+/* Child side of prefetch_next(); a block may straddle two shared chunks */
+int shared_next(struct gfk* g, struct files* f, char* buffer)
+{
+	struct prefetch* p = g->prefetch;
+	int want = chunk_size(g, f, p->consumer_offset);
+	int got = 0;
+	int take;
+	int slot;
+	long tail;
+
+	while(got < want)
+	{
+		pthread_mutex_lock(&p->shared->lock);
+		tail = p->shared_tails[p->shared_consumer];
+		while(p->shared->head == tail) pthread_cond_wait(&p->shared->not_empty, &p->shared->lock);
+		pthread_mutex_unlock(&p->shared->lock);
+
+		slot = tail % p->shared->slots;
+		take = p->shared_size[slot] - p->shared_offset;
+		if(take > (want - got)) take = want - got;
+		memcpy(buffer + got, p->shared_data + (slot * (long)SHARED_CHUNK) + p->shared_offset, take);
+		got = got + take;
+		p->shared_offset = p->shared_offset + take;
+
+		if(p->shared_offset == p->shared_size[slot])
+		{
+			p->shared_offset = 0;
+			pthread_mutex_lock(&p->shared->lock);
+			p->shared_tails[p->shared_consumer] = tail + 1;
+			pthread_cond_broadcast(&p->shared->not_full);
+			pthread_mutex_unlock(&p->shared->lock);
+		}
+	}
+	return got;
+}
+
+/* Whether most of a sample of the planned files already sit in the page cache;
+ * mincore() on an untouched mapping answers without reading anything
+ */
+#define CACHE_PROBES 16
+int inputs_cached(struct gfk* g)
+{
+	struct prefetch* p = g->prefetch;
+	long page = sysconf(_SC_PAGESIZE);
+	long step = p->count / CACHE_PROBES;
+	long i = 0;
+	int probed = 0;
+	int cached = 0;
+	unsigned char resident;
+	struct files* f;
+	void* map;
+
+	if(1 > step) step = 1;
+	while(i < p->count)
+	{
+		f = p->order[i];
+		i = i + step;
+		if((NULL != f->data) || (0 == f->size)) continue;
+		open_input(g, f);
+		map = mmap(NULL, page, PROT_READ, MAP_SHARED, f->fd, 0);
+		close_input(f);
+		if(MAP_FAILED == map) continue;
+		resident = 0;
+		if(0 == mincore(map, page, &resident))
+		{
+			probed = probed + 1;
+			if(resident & 1) cached = cached + 1;
+		}
+		munmap(map, page);
+	}
+
+	return (cached << 1) >= probed;
+}
+
+/* Call once the tree is complete and before the first prefetch_next() */
+void prefetch_start(struct gfk* g, struct folders* root)
+{
+	struct prefetch* p;
+	long slots;
+	long i;
+
+	prefetch_plan(g, root);
+	p = g->prefetch;
+
+	/* The parent is doing all of the reading for us */
+	if(NULL != p->shared)
+	{
+		p->shared_offset = 0;
+		return;
+	}
+
+	/* Less than two slots can't overlap anything. On a single core with warm
+	 * inputs the reader thread only steals time from the writer (about 20%
+	 * slower), but once reads have to wait on the disk overlapping them pays
+	 * off even there; so probe the cache before our own readahead warms it.
+	 */
+	slots = g->prefetch_budget / g->volume_block_size;
+	if((2 > slots) || ((2 > sysconf(_SC_NPROCESSORS_ONLN)) && inputs_cached(g))) slots = 0;
+
+	/* Get the kernel started on the first few files right away */
+	i = 0;
+	while(i < g->prefetch_files)
+	{
+		advise_file(g, i);
+		i = i + 1;
+	}
+
+	if(0 == slots) return;
+
+	p->ring = calloc(slots, sizeof(struct buffers*));
+	p->ring_size = calloc(slots, sizeof(int));
+	ensure(g, (NULL != p->ring) && (NULL != p->ring_size), "prefetch allocation failed\n");
+	while(p->ring_slots < slots)
+	{
+		p->ring[p->ring_slots] = create_buffer(g, g->allocated, g->volume_block_size);
+		p->ring_slots = p->ring_slots + 1;
+	}
+
+	p->ring_head = 0;
+	p->ring_tail = 0;
+	p->reader_failed = FALSE;
+	p->stopping = FALSE;
+	pthread_mutex_init(&p->ring_lock, NULL);
+	pthread_cond_init(&p->ring_not_empty, NULL);
+	pthread_cond_init(&p->ring_not_full, NULL);
+	ensure(g, 0 == pthread_create(&p->reader, NULL, reader_thread, g), "unable to start prefetch thread\n");
+	p->reader_running = TRUE;
+}
+
+/* Copies the next chunk of f into buffer and returns its size, zero once f is done
+ * (which also moves us on to the next planned file so always read until zero)
+ */
+int prefetch_next(struct gfk* g, struct files* f, char* buffer)
+{
+	struct prefetch* p = g->prefetch;
+	int failed;
+	int size;
+	int slot;
+
+	if(p->consumer_offset >= f->size)
+	{
+		/* Reading synchronously makes us the reader so we are the ones done with it */
+		if((NULL == p->shared) && (0 == p->ring_slots)) close_input(f);
+
+		/* Move along to the next file in the plan */
+		p->consumer_file = p->consumer_file + 1;
+		p->consumer_offset = 0;
+		return 0;
+	}
+	ensure(g, p->consumer_file < p->count, "writer asked for more files than were planned\n");
+	ensure(g, f == p->order[p->consumer_file], "writer visited files out of the planned order\n");
+
+	long start = stats_start(g);
+	if(NULL != p->shared)
+	{
+		size = shared_next(g, f, buffer);
+	}
+	else if(0 == p->ring_slots)
+	{
+		if(0 == p->consumer_offset) advise_file(g, p->consumer_file + g->prefetch_files);
+		size = chunk_size(g, f, p->consumer_offset);
+		read_chunk(g, f, p->consumer_offset, buffer, size);
+	}
+	else
+	{
+		pthread_mutex_lock(&p->ring_lock);
+		while((p->ring_head == p->ring_tail) && !p->reader_failed) pthread_cond_wait(&p->ring_not_empty, &p->ring_lock);
+		failed = (p->ring_head == p->ring_tail);
+		pthread_mutex_unlock(&p->ring_lock);
+		if(failed) fail(g, g->error);
+
+		slot = p->ring_tail % p->ring_slots;
+		size = p->ring_size[slot];
+		memcpy(buffer, p->ring[slot]->buffer, size);
+
+		pthread_mutex_lock(&p->ring_lock);
+		p->ring_tail = p->ring_tail + 1;
+		pthread_cond_signal(&p->ring_not_full);
+		pthread_mutex_unlock(&p->ring_lock);
+	}
+	stats_stop(g, STAT_PHASE_READ, start);
+
+	p->consumer_offset = p->consumer_offset + size;
+	g->stats.bytes_read = g->stats.bytes_read + size;
+	stats_progress(g);
+	return size;
+}
+
+/* prefetch_next() for files that were never planned; --max-memory streams
+ * them straight out of the merge so the kernel only reads ahead within each one
+ */
+int stream_next(struct gfk* g, struct files* f, char* buffer)
+{
+	struct prefetch* p = prefetch_state(g);
+	int size;
+	if(p->consumer_offset >= f->size)
+	{
+		close_input(f);
+		p->consumer_offset = 0;
+		return 0;
+	}
+
+	long start = stats_start(g);
+	if(0 == p->consumer_offset) advise_input(g, f);
+	size = chunk_size(g, f, p->consumer_offset);
+	read_chunk(g, f, p->consumer_offset, buffer, size);
+	stats_stop(g, STAT_PHASE_READ, start);
+
+	p->consumer_offset = p->consumer_offset + size;
+	g->stats.bytes_read = g->stats.bytes_read + size;
+	stats_progress(g);
+	return size;
+}
+
+/* Also how a failed build gets the reader to give up; the shared ring of a
+ * --variant child outlives the build since the child is about to exit anyway
+ */
+void prefetch_stop(struct gfk* g)
+{
+	struct prefetch* p = g->prefetch;
+	int i = 0;
+	if(NULL == p) return;
+	if(p->reader_running)
+	{
+		pthread_mutex_lock(&p->ring_lock);
+		p->stopping = TRUE;
+		pthread_cond_signal(&p->ring_not_full);
+		pthread_mutex_unlock(&p->ring_lock);
+		pthread_join(p->reader, NULL);
+		p->reader_running = FALSE;
+		pthread_mutex_destroy(&p->ring_lock);
+		pthread_cond_destroy(&p->ring_not_empty);
+		pthread_cond_destroy(&p->ring_not_full);
+	}
+	while(i < p->ring_slots)
+	{
+		remove_buffer(g, p->ring[i]);
+		i = i + 1;
+	}
+	free(p->ring);
+	free(p->ring_size);
+	free(p->order);
+	if(NULL != p->shared)
+	{
+		p->ring_slots = 0;
+		p->ring = NULL;
+		p->ring_size = NULL;
+		p->order = NULL;
+		return;
+	}
+	free(p);
+	g->prefetch = NULL;
+}
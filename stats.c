@@ -0,0 +1,276 @@
+/* Copyright (C) 2022 Jeremiah Orians
+ * This file is part of GFK
+ *
+ * GFK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GFK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GFK If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gfk_create.h"
+#include <time.h>
+#include <sys/resource.h>
+
+/* Only the builder the command line reports on, and not in --variant children */
+struct gfk* stats_reporter;
+
+char* phase_names[STAT_PHASE_COUNT] = {"stat", "read", "checksum", "write", "tree", "plan", "fsync"};
+
+long stats_now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (t.tv_sec * 1000000000L) + t.tv_nsec;
+}
+
+/* Returns a start mark; zero when nobody is listening so the hot paths stay cheap */
+long stats_start(struct gfk* g)
+{
+	if((STATS_OFF == g->stats_mode) && !g->progress_mode) return 0;
+	return stats_now();
+}
+
+void stats_stop(struct gfk* g, int phase, long start)
+{
+	if(0 == start) return;
+	/* The pool workers time their blocks too so phases add up across threads */
+	__atomic_add_fetch(&g->stats.phase_time[phase], stats_now() - start, __ATOMIC_RELAXED);
+}
+
+void stats_buffer_taken(struct gfk* g)
+{
+	long in_use = __atomic_add_fetch(&g->stats.buffers_in_use, 1, __ATOMIC_RELAXED);
+	long peak = __atomic_load_n(&g->stats.buffers_peak, __ATOMIC_RELAXED);
+	/* The pool workers take buffers too so only ever raise the peak */
+	while(in_use > peak)
+	{
+		if(__atomic_compare_exchange_n(&g->stats.buffers_peak, &peak, in_use, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+	}
+}
+
+void stats_buffer_returned(struct gfk* g)
+{
+	__atomic_sub_fetch(&g->stats.buffers_in_use, 1, __ATOMIC_RELAXED);
+}
+
+void fput_long(long x, FILE* f)
+{
+	char s[24];
+	int i = 23;
+	int negative = (x < 0);
+	s[i] = 0;
+	if(negative) x = -x;
+	do
+	{
+		i = i - 1;
+		s[i] = '0' + (x % 10);
+		x = x / 10;
+	} while(0 != x);
+	if(negative)
+	{
+		i = i - 1;
+		s[i] = '-';
+	}
+	fputs(s + i, f);
+}
+
+/* Bytes per second, guarding against sub-nanosecond phases */
+long throughput(long bytes, long nanoseconds)
+{
+	if(0 >= nanoseconds) return 0;
+	return (long)(((double)bytes * 1000000000.0) / (double)nanoseconds);
+}
+
+void stats_progress(struct gfk* g)
+{
+	if(!g->progress_mode) return;
+	long now = stats_now();
+	if((now - g->stats.last_progress) < 1000000000L) return;
+	g->stats.last_progress = now;
+
+	long elapsed = now - g->stats.started;
+	fputs("progress: ", stderr);
+	fput_long(g->stats.files_ingested, stderr);
+	fputs(" files, ", stderr);
+	fput_long(g->stats.bytes_read, stderr);
+	fputs(" bytes read (", stderr);
+	fput_long(throughput(g->stats.bytes_read, elapsed), stderr);
+	fputs(" B/s), ", stderr);
+	fput_long(g->stats.bytes_written, stderr);
+	fputs(" bytes written (", stderr);
+	fput_long(throughput(g->stats.bytes_written, elapsed), stderr);
+	fputs(" B/s)\n", stderr);
+}
+
+long max_rss()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+void json_field(char* name, long value, int last)
+{
+	fputs("\"", stderr);
+	fputs(name, stderr);
+	fputs("\": ", stderr);
+	fput_long(value, stderr);
+	if(!last) fputs(", ", stderr);
+}
+
+void stats_report_json(struct statistics* s)
+{
+	fputs("{", stderr);
+	json_field("files_ingested", s->files_ingested, FALSE);
+	json_field("bytes_ingested", s->bytes_ingested, FALSE);
+	json_field("bytes_read", s->bytes_read, FALSE);
+	json_field("bytes_written", s->bytes_written, FALSE);
+	json_field("write_syscalls", s->write_calls, FALSE);
+
+	fputs("\"blocks\": {", stderr);
+	json_field("data", s->data_blocks, FALSE);
+	json_field("file", s->file_blocks, FALSE);
+	json_field("indirect_file", s->indirect_file_blocks, FALSE);
+	json_field("directory", s->directory_blocks, FALSE);
+	json_field("indirect_directory", s->indirect_directory_blocks, FALSE);
+	json_field("packed", s->packed_blocks, FALSE);
+	json_field("name", s->name_blocks, TRUE);
+	fputs("}, ", stderr);
+	json_field("indirect_blocks", s->indirect_file_blocks + s->indirect_directory_blocks, FALSE);
+
+	fputs("\"buffers\": {", stderr);
+	json_field("allocations", s->buffer_allocations, FALSE);
+	json_field("peak_in_use", s->buffers_peak, TRUE);
+	fputs("}, ", stderr);
+
+	fputs("\"phase_ns\": {", stderr);
+	int i = 0;
+	while(i < STAT_PHASE_COUNT)
+	{
+		json_field(phase_names[i], s->phase_time[i], (STAT_PHASE_COUNT - 1) == i);
+		i = i + 1;
+	}
+	fputs("}, ", stderr);
+	json_field("total_ns", stats_now() - s->started, FALSE);
+	json_field("max_rss_kb", max_rss(), TRUE);
+	fputs("}\n", stderr);
+}
+
+void stats_report_text(struct statistics* s)
+{
+	int i = 0;
+	fputs("files ingested: ", stderr);
+	fput_long(s->files_ingested, stderr);
+	fputs(" (", stderr);
+	fput_long(s->bytes_ingested, stderr);
+	fputs(" bytes)\nblocks: ", stderr);
+	fput_long(s->data_blocks, stderr);
+	fputs(" data, ", stderr);
+	fput_long(s->file_blocks, stderr);
+	fputs(" file, ", stderr);
+	fput_long(s->indirect_file_blocks, stderr);
+	fputs(" indirect file, ", stderr);
+	fput_long(s->directory_blocks, stderr);
+	fputs(" directory, ", stderr);
+	fput_long(s->indirect_directory_blocks, stderr);
+	fputs(" indirect directory, ", stderr);
+	fput_long(s->packed_blocks, stderr);
+	fputs(" packed, ", stderr);
+	fput_long(s->name_blocks, stderr);
+	fputs(" name\nbuffers: ", stderr);
+	fput_long(s->buffer_allocations, stderr);
+	fputs(" allocated, ", stderr);
+	fput_long(s->buffers_peak, stderr);
+	fputs(" peak in use\nwrites: ", stderr);
+	fput_long(s->write_calls, stderr);
+	fputs(" syscalls, ", stderr);
+	fput_long(s->bytes_written, stderr);
+	fputs(" bytes\nmax rss: ", stderr);
+	fput_long(max_rss(), stderr);
+	fputs("KB\n", stderr);
+	while(i < STAT_PHASE_COUNT)
+	{
+		fputs(phase_names[i], stderr);
+		fputs(": ", stderr);
+		fput_long(s->phase_time[i] / 1000, stderr);
+		fputs("us\n", stderr);
+		i = i + 1;
+	}
+}
+
+void stats_report()
+{
+	if(NULL == stats_reporter) return;
+	if(STATS_JSON == stats_reporter->stats_mode) stats_report_json(&stats_reporter->stats);
+	else if(STATS_TEXT == stats_reporter->stats_mode) stats_report_text(&stats_reporter->stats);
+}
+
+/* Start counting from now */
+void stats_clear(struct gfk* g)
+{
+	memset(&g->stats, 0, sizeof(struct statistics));
+	g->stats.started = stats_now();
+	g->stats.last_progress = g->stats.started;
+}
+
+/* For the command line, which reports on g when the process ends */
+void stats_init(struct gfk* g, char** argv)
+{
+	/* Files are ingested while options are parsed so look ahead for our flags */
+	int i = 1;
+	while(NULL != argv[i])
+	{
+		if(match(argv[i], "--stats")) g->stats_mode = STATS_TEXT;
+		else if(match(argv[i], "--stats=json")) g->stats_mode = STATS_JSON;
+		else if(match(argv[i], "--progress")) g->progress_mode = TRUE;
+		i = i + 1;
+	}
+
+	stats_clear(g);
+	stats_reporter = g;
+	/* Make sure we still get numbers when we bail out early */
+	atexit(stats_report);
+}
+
+/* For a --variant child; count only what it does and leave the talking to the parent */
+void stats_child(struct gfk* g)
+{
+	long started = g->stats.started;
+	memset(&g->stats, 0, sizeof(struct statistics));
+	g->stats.started = started;
+	g->stats.last_progress = started;
+	stats_reporter = NULL;
+	g->progress_mode = FALSE;
+}
+
+/* Fold in what a --variant child did; the ingest and the reading were all ours */
+void stats_merge(struct gfk* g, struct statistics* s)
+{
+	struct statistics* stats = &g->stats;
+	int i = 0;
+	stats->bytes_written = stats->bytes_written + s->bytes_written;
+	stats->write_calls = stats->write_calls + s->write_calls;
+	stats->data_blocks = stats->data_blocks + s->data_blocks;
+	stats->file_blocks = stats->file_blocks + s->file_blocks;
+	stats->indirect_file_blocks = stats->indirect_file_blocks + s->indirect_file_blocks;
+	stats->directory_blocks = stats->directory_blocks + s->directory_blocks;
+	stats->indirect_directory_blocks = stats->indirect_directory_blocks + s->indirect_directory_blocks;
+	stats->packed_blocks = stats->packed_blocks + s->packed_blocks;
+	stats->name_blocks = stats->name_blocks + s->name_blocks;
+	stats->buffer_allocations = stats->buffer_allocations + s->buffer_allocations;
+	if(s->buffers_peak > stats->buffers_peak) stats->buffers_peak = s->buffers_peak;
+	while(i < STAT_PHASE_COUNT)
+	{
+		/* The children only waited on our reads */
+		if(STAT_PHASE_READ != i) stats->phase_time[i] = stats->phase_time[i] + s->phase_time[i];
+		i = i + 1;
+	}
+}
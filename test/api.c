@@ -0,0 +1,139 @@
+/* Copyright (C) 2022 Jeremiah Orians
+ * This file is part of GFK
+ *
+ * GFK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GFK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GFK If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "../gfk_create.h"
+#include <pthread.h>
+
+/* Builders running side by side have to come out the same as one on its own,
+ * and a build that can't work has to come back as an error
+ */
+#define FILES 300
+#define BUILDERS 4
+
+char contents[FILES][64];
+char names[FILES][64];
+
+struct build
+{
+	char* image;
+	long size;
+};
+
+void check(int ok, char* what)
+{
+	if(ok) return;
+	fputs("api test failed: ", stderr);
+	fputs(what, stderr);
+	fputs("\n", stderr);
+	exit(EXIT_FAILURE);
+}
+
+struct gfk* new_builder()
+{
+	struct gfk* g = gfk_new();
+	int i = 0;
+	check(NULL != g, "gfk_new");
+	check(1 == gfk_option(g, "--quiet", NULL), "--quiet");
+	check(2 == gfk_option(g, "-vbs", "512"), "-vbs");
+	check(1 == gfk_option(g, "--pack-tails", NULL), "--pack-tails");
+	check(2 == gfk_option(g, "--threads", "2"), "--threads");
+	while(i < FILES)
+	{
+		check(0 == gfk_add_buffer(g, names[i], contents[i], 1 + (i % 63)), "gfk_add_buffer");
+		i = i + 1;
+	}
+	return g;
+}
+
+/* Ask how big it is first, then build it for real */
+void* build(void* item)
+{
+	struct build* b = item;
+	struct gfk* g = new_builder();
+	char probe[512];
+	gfk_output_buffer(g, probe, sizeof(probe));
+	check(0 > gfk_build(g), "an image bigger than the buffer");
+	check(NULL == gfk_error(g), "too small isn't an error");
+	b->size = gfk_image_size(g);
+	b->image = calloc(b->size, sizeof(char));
+	check(NULL != b->image, "calloc failed");
+	gfk_output_buffer(g, b->image, b->size);
+	check(b->size == gfk_build(g), "gfk_build");
+	gfk_free(g);
+	return NULL;
+}
+
+int main()
+{
+	struct build alone;
+	struct build together[BUILDERS];
+	pthread_t threads[BUILDERS];
+	char image[4096];
+	char long_name[600];
+	struct gfk* g;
+	int i = 0;
+
+	while(i < FILES)
+	{
+		strcpy(names[i], "folder");
+		if(i & 1) strcat(names[i], "/odd/file");
+		else strcat(names[i], "/even/file");
+		strcat(names[i], int2str(i, 10, FALSE));
+		memset(contents[i], 'a' + (i % 26), sizeof(contents[i]));
+		i = i + 1;
+	}
+
+	build(&alone);
+	i = 0;
+	while(i < BUILDERS)
+	{
+		check(0 == pthread_create(threads + i, NULL, build, together + i), "pthread_create");
+		i = i + 1;
+	}
+	i = 0;
+	while(i < BUILDERS)
+	{
+		pthread_join(threads[i], NULL);
+		check(alone.size == together[i].size, "concurrent image size");
+		check(0 == memcmp(alone.image, together[i].image, alone.size), "concurrent image contents");
+		free(together[i].image);
+		i = i + 1;
+	}
+	free(alone.image);
+
+	/* None of these may take the process down with them */
+	g = gfk_new();
+	check(1 == gfk_option(g, "--quiet", NULL), "--quiet");
+	check(2 == gfk_option(g, "-vbs", "512"), "-vbs");
+	check(-1 == gfk_option(g, "-bps", "3"), "a bad option value");
+	check(NULL != gfk_error(g), "a bad option value says why");
+	check(-1 == gfk_add_path(g, "/nonexistent/gfk"), "a missing file");
+	check(NULL != gfk_error(g), "a missing file says why");
+
+	memset(long_name, 'n', sizeof(long_name) - 1);
+	long_name[sizeof(long_name) - 1] = 0;
+	check(0 == gfk_add_buffer(g, long_name, "x", 1), "a long name is fine until the block size is known");
+	gfk_output_buffer(g, image, sizeof(image));
+	check(-1 == gfk_build(g), "a name longer than the block size");
+	check(NULL != gfk_error(g), "a long name says why");
+	gfk_free(g);
+
+	fputs("api: ", stdout);
+	fputs(int2str(BUILDERS, 10, FALSE), stdout);
+	fputs(" concurrent builds matched and errors came back\n", stdout);
+	return EXIT_SUCCESS;
+}
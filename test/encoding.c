@@ -0,0 +1,229 @@
+/* Copyright (C) 2022 Jeremiah Orians
+ * This file is part of GFK
+ *
+ * GFK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GFK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GFK If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "../gfk_create.h"
+
+/* Round trips every encoder select_encoders() can pick through a byte at a
+ * time decoder written straight from the standard
+ */
+#define NODES 37
+#define GUARD 16
+
+/* Only ever used for its encoding options and the encoders they select */
+struct gfk* g;
+
+unsigned long seed = 88172645463325252UL;
+
+unsigned long next_random()
+{
+	seed = seed ^ (seed << 13);
+	seed = seed ^ (seed >> 7);
+	seed = seed ^ (seed << 17);
+	return seed;
+}
+
+/* Every value that fits in bytes, with the extremes showing up often */
+unsigned long random_field(int bytes)
+{
+	unsigned long mask = ~0UL;
+	unsigned long pick = next_random();
+	if(0 == bytes) return 0;
+	if(8 > bytes) mask = (1UL << (bytes << 3)) - 1;
+	if(0 == (pick % 7)) return 0;
+	if(1 == (pick % 7)) return mask;
+	return next_random() & mask;
+}
+
+unsigned long decode_field(unsigned char* s, int bytes, int big)
+{
+	unsigned long value = 0;
+	int i = 0;
+	while(i < bytes)
+	{
+		if(big) value = (value << 8) | s[i];
+		else value = value | (((unsigned long)s[i]) << (i << 3));
+		i = i + 1;
+	}
+	return value;
+}
+
+char* combination()
+{
+	static char name[128];
+	strcpy(name, "bps=");
+	strcat(name, int2str(g->block_pointer_size, 10, FALSE));
+	strcat(name, " cs=");
+	strcat(name, int2str(g->checksum_size, 10, FALSE));
+	strcat(name, " fsbs=");
+	strcat(name, int2str(g->file_size_size, 10, FALSE));
+	if(g->BigByteEndian) strcat(name, " big");
+	else strcat(name, " little");
+	return name;
+}
+
+void check(int ok, char* what)
+{
+	if(ok) return;
+	fputs("encoding round trip failed (", stderr);
+	fputs(combination(), stderr);
+	fputs("): ", stderr);
+	fputs(what, stderr);
+	fputs("\n", stderr);
+	exit(EXIT_FAILURE);
+}
+
+/* Nothing past the last node may be touched */
+void check_guard(unsigned char* s, int used)
+{
+	int i = used;
+	while(i < (used + GUARD))
+	{
+		check(0xA5 == s[i], "wrote past the end of the nodes");
+		i = i + 1;
+	}
+}
+
+void round_trip_inodes(int count)
+{
+	struct inode in[NODES];
+	unsigned char s[(NODES * 16) + GUARD];
+	int width = g->checksum_size / 8;
+	int i = 0;
+	while(i < count)
+	{
+		in[i].address = random_field(g->block_pointer_size);
+		in[i].checksum = random_field(width);
+		i = i + 1;
+	}
+
+	memset(s, 0xA5, sizeof(s));
+	g->encode_inodes(g, (char*)s, in, count);
+	i = 0;
+	while(i < count)
+	{
+		check(in[i].address == decode_field(s + (i * g->inode_size), g->block_pointer_size, g->BigByteEndian), "inode address");
+		check(in[i].checksum == decode_field(s + (i * g->inode_size) + g->block_pointer_size, width, g->BigByteEndian), "inode checksum");
+		i = i + 1;
+	}
+	check_guard(s, count * g->inode_size);
+}
+
+void round_trip_dnodes(int count)
+{
+	struct dnode in[NODES];
+	unsigned char s[(NODES * 40) + GUARD];
+	int width = g->checksum_size / 8;
+	unsigned char* node;
+	int i = 0;
+	while(i < count)
+	{
+		in[i].name.address = random_field(g->block_pointer_size);
+		in[i].name.checksum = random_field(width);
+		in[i].contents.address = random_field(g->block_pointer_size);
+		in[i].contents.checksum = random_field(width);
+		in[i].size = random_field(g->file_size_size);
+		i = i + 1;
+	}
+
+	memset(s, 0xA5, sizeof(s));
+	g->encode_dnodes(g, (char*)s, in, count);
+	i = 0;
+	while(i < count)
+	{
+		node = s + (i * g->dnode_size);
+		check(in[i].name.address == decode_field(node, g->block_pointer_size, g->BigByteEndian), "dnode name address");
+		check(in[i].name.checksum == decode_field(node + g->block_pointer_size, width, g->BigByteEndian), "dnode name checksum");
+		check(in[i].contents.address == decode_field(node + g->inode_size, g->block_pointer_size, g->BigByteEndian), "dnode contents address");
+		check(in[i].contents.checksum == decode_field(node + g->inode_size + g->block_pointer_size, width, g->BigByteEndian), "dnode contents checksum");
+		check(in[i].size == decode_field(node + (g->inode_size << 1), g->file_size_size, g->BigByteEndian), "dnode file size");
+		i = i + 1;
+	}
+	check_guard(s, count * g->dnode_size);
+}
+
+void round_trip_slice()
+{
+	unsigned char s[8 + GUARD];
+	unsigned long value = random_field(8);
+	memset(s, 0xA5, sizeof(s));
+	g->put_slice((char*)s, value);
+	check(value == decode_field(s, 8, g->BigByteEndian), "leadblock field");
+	check_guard(s, 8);
+}
+
+int main()
+{
+	int pointers[3] = {2, 4, 8};
+	int checksums[4] = {0, 16, 32, 64};
+	int file_sizes[3] = {2, 4, 8};
+	int counts[4] = {0, 1, 2, NODES};
+	int combinations = 0;
+	int p = 0;
+	int c;
+	int f;
+	int e;
+	int n;
+	int round;
+
+	g = gfk_new();
+	while(p < 3)
+	{
+		c = 0;
+		while(c < 4)
+		{
+			f = 0;
+			while(f < 3)
+			{
+				e = 0;
+				while(e < 2)
+				{
+					g->block_pointer_size = pointers[p];
+					g->checksum_size = checksums[c];
+					g->file_size_size = file_sizes[f];
+					g->BigByteEndian = (0 == e);
+					g->inode_size = g->block_pointer_size + (g->checksum_size / 8);
+					g->dnode_size = (g->inode_size << 1) + g->file_size_size;
+					select_encoders(g);
+
+					n = 0;
+					while(n < 4)
+					{
+						round = 0;
+						while(round < 16)
+						{
+							round_trip_inodes(counts[n]);
+							round_trip_dnodes(counts[n]);
+							round = round + 1;
+						}
+						n = n + 1;
+					}
+					round_trip_slice();
+					combinations = combinations + 1;
+					e = e + 1;
+				}
+				f = f + 1;
+			}
+			c = c + 1;
+		}
+		p = p + 1;
+	}
+
+	fputs("encoding: ", stdout);
+	fputs(int2str(combinations, 10, FALSE), stdout);
+	fputs(" combinations round tripped\n", stdout);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,178 @@
+/* Copyright (C) 2022 Jeremiah Orians
+ * This file is part of GFK
+ *
+ * GFK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GFK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GFK If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gfk_create.h"
+#include <sys/wait.h>
+#include <sys/mman.h>
+
+/* Takes something like output=a.img,vbs=512,little,cs=16 */
+void add_variant(struct gfk* g, char* spec)
+{
+	struct variants* v = calloc(1, sizeof(struct variants));
+	require(NULL != v, "calloc failed in add_variant\n");
+	v->BigByteEndian = -1;
+	v->checksum_mode = -1;
+
+	char* key = spec;
+	char* value;
+	char* next;
+	while(NULL != key)
+	{
+		next = strchr(key, ',');
+		if(NULL != next)
+		{
+			next[0] = 0;
+			next = next + 1;
+		}
+		value = strchr(key, '=');
+		if(NULL != value)
+		{
+			value[0] = 0;
+			value = value + 1;
+		}
+
+		if(match(key, "big")) v->BigByteEndian = TRUE;
+		else if(match(key, "little")) v->BigByteEndian = FALSE;
+		else
+		{
+			require(NULL != value, "variant options other than big and little need a value\n");
+			if(match(key, "output") || match(key, "o")) v->output = value;
+			else if(match(key, "vbs")) v->volume_block_size = strtoint(value);
+			else if(match(key, "nbs")) v->native_block_size = strtoint(value);
+			else if(match(key, "bps")) v->block_pointer_size = strtoint(value);
+			else if(match(key, "ca")) v->checksum_mode = strtoint(value);
+			else if(match(key, "cs")) v->checksum_size = strtoint(value);
+			else
+			{
+				fputs("Unknown variant option: ", stderr);
+				fputs(key, stderr);
+				fputs("\n", stderr);
+				exit(EXIT_FAILURE);
+			}
+		}
+		key = next;
+	}
+	require(NULL != v->output, "every --variant needs its own output=\n");
+
+	/* Keep them in the order given so the reports line up with the command line */
+	v->index = g->variant_count;
+	g->variant_count = g->variant_count + 1;
+	if(NULL == g->variants)
+	{
+		g->variants = v;
+		return;
+	}
+	struct variants* walk = g->variants;
+	while(NULL != walk->next) walk = walk->next;
+	walk->next = v;
+}
+
+void apply_variant(struct gfk* g, struct variants* v)
+{
+	if(0 <= v->BigByteEndian) g->BigByteEndian = v->BigByteEndian;
+	if(0 <= v->checksum_mode) g->checksum_mode = v->checksum_mode;
+	if(0 != v->volume_block_size) g->volume_block_size = v->volume_block_size;
+	if(0 != v->native_block_size) g->native_block_size = v->native_block_size;
+	if(0 != v->block_pointer_size) g->block_pointer_size = v->block_pointer_size;
+	if(0 != v->checksum_size) g->checksum_size = v->checksum_size;
+	require(64 < g->volume_block_size, "we don't support volume block sizes smaller than 64bytes\n");
+}
+
+void reap_variant(struct gfk* g, struct variants* v, int status)
+{
+	v->pid = 0;
+	v->failed = !WIFEXITED(status) || (EXIT_SUCCESS != WEXITSTATUS(status));
+	prefetch_release_consumer(g, v->index);
+}
+
+/* Called by the reader whenever it has been stuck waiting on the children */
+void reap_variants(struct gfk* g)
+{
+	struct variants* v = g->variants;
+	int status;
+	while(NULL != v)
+	{
+		if((0 != v->pid) && (v->pid == waitpid(v->pid, &status, WNOHANG)))
+		{
+			reap_variant(g, v, status);
+		}
+		v = v->next;
+	}
+}
+
+/* One child per variant shares the ingested tree; we do all the input reading */
+int build_variants(struct gfk* g)
+{
+	struct variants* v = g->variants;
+	int failures = 0;
+	int status;
+
+	prefetch_share(g, g->filesystem, g->variant_count);
+	g->variant_stats = mmap(NULL, g->variant_count * sizeof(struct statistics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	require(MAP_FAILED != g->variant_stats, "unable to map shared variant statistics\n");
+
+	/* Don't let the children inherit and repeat our buffered output */
+	fflush(stdout);
+	fflush(stderr);
+
+	while(NULL != v)
+	{
+		v->pid = fork();
+		require(0 <= v->pid, "unable to fork for --variant\n");
+		if(0 == v->pid)
+		{
+			stats_child(g);
+			prefetch_consumer(g, v->index);
+			apply_variant(g, v);
+			gfk_output_path(g, v->output);
+			status = EXIT_SUCCESS;
+			if(0 > gfk_build(g))
+			{
+				fputs(gfk_error(g), stderr);
+				status = EXIT_FAILURE;
+			}
+			g->variant_stats[v->index] = g->stats;
+			prefetch_release_consumer(g, v->index);
+			exit(status);
+		}
+		v = v->next;
+	}
+
+	prefetch_serve(g, reap_variants);
+
+	v = g->variants;
+	while(NULL != v)
+	{
+		if(0 != v->pid)
+		{
+			require(v->pid == waitpid(v->pid, &status, 0), "lost track of a --variant child\n");
+			reap_variant(g, v, status);
+		}
+		stats_merge(g, g->variant_stats + v->index);
+		if(v->failed)
+		{
+			fputs("variant failed: ", stderr);
+			fputs(v->output, stderr);
+			fputs("\n", stderr);
+			failures = failures + 1;
+		}
+		v = v->next;
+	}
+
+	if(0 != failures) return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}